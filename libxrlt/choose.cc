@@ -12,6 +12,7 @@ xrltChooseCompile(xrltRequestsheetPtr sheet, xmlNodePtr node, void *prevcomp)
     xrltChooseData      *ret = NULL;
     xmlChar             *expr = NULL;
     int                  i;
+    int                  j;
     xmlNodePtr           tmp;
     xrltBool             otherwise = FALSE;
     xrltNodeDataPtr      n;
@@ -62,18 +63,15 @@ xrltChooseCompile(xrltRequestsheetPtr sheet, xmlNodePtr node, void *prevcomp)
                 goto error;
             }
 
-            ret->cases[i].test.xpathval.expr = xmlXPathCompile(expr);
-
-            xmlFree(expr);
-
-            ret->cases[i].test.type = XRLT_VALUE_XPATH;
-
-            if (ret->cases[i].test.xpathval.expr == NULL) {
+            if (!xrltXPathCompileTest(sheet, expr, &ret->cases[i].test)) {
+                xmlFree(expr);
                 xrltTransformError(NULL, sheet, tmp,
                                    "Failed to compile expression\n");
                 goto error;
             }
 
+            xmlFree(expr);
+
             ret->cases[i].test.xpathval.src = tmp;
             ret->cases[i].test.xpathval.scope = node->parent;
         } else {
@@ -91,6 +89,26 @@ xrltChooseCompile(xrltRequestsheetPtr sheet, xmlNodePtr node, void *prevcomp)
         tmp = tmp->next;
     }
 
+    // Cases with constant tests are folded: the false ones are dropped and
+    // the first true one becomes otherwise.
+    for (i = 0, j = 0; i < ret->len; i++) {
+        if (ret->cases[i].test.type == XRLT_VALUE_INT) {
+            if (!ret->cases[i].test.intval) { continue; }
+
+            ret->cases[i].test.type = XRLT_VALUE_EMPTY;
+        }
+
+        ret->cases[j++] = ret->cases[i];
+
+        if (ret->cases[i].test.type == XRLT_VALUE_EMPTY) { break; }
+    }
+
+    for (i++; i < ret->len; i++) {
+        CLEAR_XRLT_VALUE(ret->cases[i].test);
+    }
+
+    ret->len = j;
+
     return ret;
 
   error:
@@ -110,9 +128,7 @@ xrltChooseFree(void *comp)
         d = (xrltChooseData *)comp;
 
         for (i = 0; i < d->len; i++)  {
-            if (d->cases[i].test.xpathval.expr != NULL) {
-                xmlXPathFreeCompExpr(d->cases[i].test.xpathval.expr);
-            }
+            CLEAR_XRLT_VALUE(d->cases[i].test);
         }
 
         xmlFree(d);
@@ -130,23 +146,30 @@ xrltChooseTransformingFree(void *data)
 }
 
 
-DEFINE_TRANSFORM_FUNCTION(
-    xrltChooseTransform,
+static DEFINE_TRANSFORM_FUNCTION(
+    xrltChooseTestTransform,
     xrltChooseData*,
     xrltChooseTransformingData*,
     sizeof(xrltChooseTransformingData),
     xrltChooseTransformingFree,
     ;,
     {
-        NEW_CHILD(ctx, tdata->testNode, tdata->node, "t");
+        if (tcomp->cases[0].test.type == XRLT_VALUE_EMPTY) {
+            // Folded to a single branch.
+            NEW_CHILD(ctx, tdata->retNode, tdata->node, "r");
 
-        TRANSFORM_TO_BOOLEAN(
-            ctx, tdata->testNode, &tcomp->cases[0].test, &tdata->test
-        );
+            TRANSFORM_SUBTREE(ctx, tcomp->cases[0].children, tdata->retNode);
+        } else {
+            NEW_CHILD(ctx, tdata->testNode, tdata->node, "t");
+
+            TRANSFORM_TO_BOOLEAN(
+                ctx, tdata->testNode, &tcomp->cases[0].test, &tdata->test
+            );
+        }
     },
     {
         if (tdata->testNode != NULL) {
-            WAIT_FOR_NODE(ctx, tdata->testNode, xrltChooseTransform);
+            WAIT_FOR_NODE(ctx, tdata->testNode, xrltChooseTestTransform);
 
             if (tdata->test) {
                 tdata->testNode = NULL;
@@ -157,7 +180,7 @@ DEFINE_TRANSFORM_FUNCTION(
                     ctx, tcomp->cases[tdata->pos].children, tdata->retNode
                 );
 
-                CALL_AGAIN(ctx, xrltChooseTransform);
+                CALL_AGAIN(ctx, xrltChooseTestTransform);
             } else {
                 tdata->pos++;
 
@@ -166,21 +189,34 @@ DEFINE_TRANSFORM_FUNCTION(
                     {
                         tdata->test = TRUE;
 
-                        return xrltChooseTransform(ctx, comp, insert, data);
+                        return xrltChooseTestTransform(ctx, comp, insert, data);
                     } else {
                         TRANSFORM_TO_BOOLEAN(
                             ctx, tdata->testNode,
                             &tcomp->cases[tdata->pos].test, &tdata->test
                         );
 
-                        CALL_AGAIN(ctx, xrltChooseTransform);
+                        CALL_AGAIN(ctx, xrltChooseTestTransform);
                     }
                 }
             }
         }
 
         if (tdata->retNode != NULL) {
-            WAIT_FOR_NODE(ctx, tdata->retNode, xrltChooseTransform);
+            WAIT_FOR_NODE(ctx, tdata->retNode, xrltChooseTestTransform);
         }
     }
 );
+
+
+xrltBool
+xrltChooseTransform(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
+                    void *data)
+{
+    // Nothing at all when every test is known to be false.
+    if (data == NULL && comp != NULL && ((xrltChooseData *)comp)->len == 0) {
+        return TRUE;
+    }
+
+    return xrltChooseTestTransform(ctx, comp, insert, data);
+}
@@ -31,9 +31,7 @@ xrltCopyOfCompile(xrltRequestsheetPtr sheet, xmlNodePtr node, void *prevcomp)
     ret->select.type = XRLT_VALUE_XPATH;
     ret->select.xpathval.src = node;
     ret->select.xpathval.scope = node->parent;
-    ret->select.xpathval.expr = xmlXPathCompile(select);
-
-    if (ret->select.xpathval.expr == NULL) {
+    if (!xrltXPathCompile(sheet, select, &ret->select.xpathval)) {
         xrltTransformError(NULL, sheet, node,
                            "Failed to compile expression\n");
         goto error;
@@ -2,16 +2,83 @@
  * Copyright Marat Abdullin (https://github.com/hoho)
  */
 
+#include <limits.h>
+#include <math.h>
+
 #include "transform.h"
 #include "foreach.h"
 
 
+// Items of an inline body transformed per call.
+#define XRLT_FOREACH_BATCH   256
+
+
+typedef struct {
+    xmlChar   *str;
+    double     num;
+} xrltSortKey;
+
+
+typedef struct {
+    int                pos;
+    xrltSortKey       *keys;
+    xrltForEachData   *comp;
+} xrltSortItem;
+
+
+static inline xrltBool
+xrltIsSortElement(xmlNodePtr node)
+{
+    return node->type == XML_ELEMENT_NODE && node->ns != NULL &&
+           xmlStrEqual(node->ns->href, XRLT_NS) &&
+           xmlStrEqual(node->name, (const xmlChar *)"sort");
+}
+
+
+static xrltBool
+xrltForEachCompileNumber(xrltRequestsheetPtr sheet, xmlNodePtr node,
+                         const xmlChar *attr, xrltCompiledValue *val)
+{
+    xmlChar         *expr;
+    const xmlChar   *c;
+
+    expr = xmlGetProp(node, attr);
+
+    if (expr == NULL) { return TRUE; }
+
+    // Plain numbers don't need XPath at all.
+    for (c = expr; *c >= '0' && *c <= '9'; c++);
+
+    if (c > expr && *c == '\0' && c - expr < 10) {
+        val->type = XRLT_VALUE_INT;
+        val->intval = atoi((const char *)expr);
+    } else {
+        val->type = XRLT_VALUE_XPATH;
+        val->xpathval.src = node;
+        val->xpathval.scope = node->parent;
+
+        if (!xrltXPathCompile(sheet, expr, &val->xpathval)) {
+            xrltTransformError(NULL, sheet, node,
+                               "Failed to compile '%s' expression\n", attr);
+            xmlFree(expr);
+            return FALSE;
+        }
+    }
+
+    xmlFree(expr);
+
+    return TRUE;
+}
+
+
 void *
 xrltForEachCompile(xrltRequestsheetPtr sheet, xmlNodePtr node, void *prevcomp)
 {
     xrltForEachData  *ret = NULL;
     xmlChar          *select = NULL;
     xrltNodeDataPtr   n;
+    xmlNodePtr        tmp;
+    int               i;
 
     if (node->children == NULL) {
         xrltTransformError(NULL, sheet, node, "Element is empty\n");
@@ -33,21 +100,63 @@ xrltForEachCompile(xrltRequestsheetPtr sheet, xmlNodePtr node, void *prevcomp)
 
     n->parentScope = 1;
 
+    // The for-each's own expressions (select, offset, limit and sort keys)
+    // are evaluated in the scope the for-each is in. Looking them up through
+    // the for-each would take the scope of whichever iteration of an outer
+    // for-each has been started last.
     ret->select.type = XRLT_VALUE_XPATH;
     ret->select.xpathval.src = node;
-    ret->select.xpathval.scope = node;
-    ret->select.xpathval.expr = xmlXPathCompile(select);
-
-    if (ret->select.xpathval.expr == NULL) {
+    ret->select.xpathval.scope = node->parent;
+    if (!xrltXPathCompile(sheet, select, &ret->select.xpathval)) {
         xrltTransformError(NULL, sheet, node,
                            "Failed to compile expression\n");
         goto error;
     }
 
     xmlFree(select);
+    select = NULL;
+
+    if (!xrltForEachCompileNumber(sheet, node, XRLT_ELEMENT_ATTR_OFFSET,
+                                  &ret->offset) ||
+        !xrltForEachCompileNumber(sheet, node, XRLT_ELEMENT_ATTR_LIMIT,
+                                  &ret->limit))
+    {
+        goto error;
+    }
+
+    // Sort keys go first, they are compiled already.
+    for (tmp = node->children; tmp != NULL && xrltIsSortElement(tmp);
+         tmp = tmp->next)
+    {
+        ret->sortLen++;
+    }
+
+    if (tmp == NULL) {
+        xrltTransformError(NULL, sheet, node, "Element is empty\n");
+        goto error;
+    }
+
+    if (ret->sortLen > 0) {
+        ret->sort = (xrltSortData **)xmlMalloc(sizeof(xrltSortData *) *
+                                               ret->sortLen);
+
+        if (ret->sort == NULL) {
+            ERROR_OUT_OF_MEMORY(NULL, sheet, node);
+            goto error;
+        }
+
+        for (i = 0, tmp = node->children; i < ret->sortLen;
+             i++, tmp = tmp->next)
+        {
+            ASSERT_NODE_DATA_GOTO(tmp, n);
+
+            ret->sort[i] = (xrltSortData *)n->data;
+        }
+    }
 
     ret->node = node;
-    ret->children = node->children;
+    ret->children = tmp;
+    ret->inlined = xrltCanTransformInline(tmp);
 
     return ret;
 
@@ -63,12 +172,342 @@ void
 xrltForEachFree(void *comp)
 {
     if (comp != NULL) {
-        CLEAR_XRLT_VALUE(((xrltForEachData *)comp)->select);
+        xrltForEachData  *fcomp = (xrltForEachData *)comp;
+
+        CLEAR_XRLT_VALUE(fcomp->select);
+        CLEAR_XRLT_VALUE(fcomp->offset);
+        CLEAR_XRLT_VALUE(fcomp->limit);
+
+        // Sort keys belong to their elements.
+        if (fcomp->sort != NULL) { xmlFree(fcomp->sort); }
+
         xmlFree(comp);
     }
 }
 
 
+void *
+xrltSortCompile(xrltRequestsheetPtr sheet, xmlNodePtr node, void *prevcomp)
+{
+    xrltSortData  *ret = NULL;
+    xmlChar       *select = NULL;
+    xmlChar       *attr = NULL;
+    xmlNodePtr     tmp;
+
+    tmp = node->parent;
+
+    if (tmp == NULL || tmp->ns == NULL || !xmlStrEqual(tmp->ns->href, XRLT_NS)
+        || !xmlStrEqual(tmp->name, (const xmlChar *)"for-each"))
+    {
+        ERROR_UNEXPECTED_ELEMENT(NULL, sheet, node);
+        return NULL;
+    }
+
+    for (tmp = node->prev; tmp != NULL; tmp = tmp->prev) {
+        if (!xrltIsSortElement(tmp)) {
+            ERROR_UNEXPECTED_ELEMENT(NULL, sheet, node);
+            return NULL;
+        }
+    }
+
+    if (node->children != NULL) {
+        ERROR_UNEXPECTED_ELEMENT(NULL, sheet, node->children);
+        return NULL;
+    }
+
+    XRLT_MALLOC(NULL, sheet, node, ret, xrltSortData *, sizeof(xrltSortData),
+                NULL);
+
+    ret->node = node;
+
+    select = xmlGetProp(node, XRLT_ELEMENT_ATTR_SELECT);
+
+    ret->select.src = node;
+    ret->select.scope = node->parent->parent;
+
+    if (!xrltXPathCompile(sheet,
+                          select == NULL ? (const xmlChar *)"." : select,
+                          &ret->select))
+    {
+        xrltTransformError(NULL, sheet, node,
+                           "Failed to compile expression\n");
+        goto error;
+    }
+
+    attr = xmlGetProp(node, XRLT_ELEMENT_ATTR_ORDER);
+
+    if (attr != NULL) {
+        if (xmlStrEqual(attr, (const xmlChar *)"descending")) {
+            ret->descending = TRUE;
+        } else if (!xmlStrEqual(attr, (const xmlChar *)"ascending")) {
+            xrltTransformError(NULL, sheet, node,
+                               "Invalid 'order' attribute\n");
+            goto error;
+        }
+
+        xmlFree(attr);
+    }
+
+    attr = xmlGetProp(node, XRLT_ELEMENT_ATTR_DATA_TYPE);
+
+    if (attr != NULL) {
+        if (xmlStrEqual(attr, (const xmlChar *)"number")) {
+            ret->number = TRUE;
+        } else if (!xmlStrEqual(attr, (const xmlChar *)"text")) {
+            xrltTransformError(NULL, sheet, node,
+                               "Invalid 'data-type' attribute\n");
+            goto error;
+        }
+
+        xmlFree(attr);
+    }
+
+    if (select != NULL) { xmlFree(select); }
+
+    return ret;
+
+  error:
+    if (select != NULL) { xmlFree(select); }
+    if (attr != NULL) { xmlFree(attr); }
+    xrltSortFree(ret);
+
+    return NULL;
+}
+
+
+void
+xrltSortFree(void *comp)
+{
+    if (comp != NULL) {
+        xrltSortData  *scomp = (xrltSortData *)comp;
+
+        if (scomp->select.compiled != NULL) {
+            xrltXPathRelease(scomp->select.compiled);
+        }
+
+        xmlFree(comp);
+    }
+}
+
+
+static int
+xrltSortCompare(const void *a, const void *b)
+{
+    const xrltSortItem  *x = (const xrltSortItem *)a;
+    const xrltSortItem  *y = (const xrltSortItem *)b;
+    xrltSortData        *s;
+    double               p;
+    double               q;
+    int                  i;
+    int                  r;
+
+    for (i = 0; i < x->comp->sortLen; i++) {
+        s = x->comp->sort[i];
+
+        if (s->number) {
+            p = x->keys[i].num;
+            q = y->keys[i].num;
+
+            // NaN goes before any number.
+            if (xmlXPathIsNaN(p)) {
+                r = xmlXPathIsNaN(q) ? 0 : -1;
+            } else if (xmlXPathIsNaN(q)) {
+                r = 1;
+            } else {
+                r = p < q ? -1 : (p > q ? 1 : 0);
+            }
+        } else {
+            r = xmlStrcmp(x->keys[i].str, y->keys[i].str);
+        }
+
+        if (r != 0) { return s->descending ? -r : r; }
+    }
+
+    // Equal items keep the document order.
+    return x->pos - y->pos;
+}
+
+
+static xrltBool
+xrltForEachSort(xrltContextPtr ctx, xrltForEachData *comp, xmlNodePtr insert,
+                xmlNodeSetPtr val, xmlNodePtr *wait)
+{
+    // Every key is evaluated once, then the items are sorted by the keys.
+    xrltSortItem        *items = NULL;
+    xrltSortKey         *keys = NULL;
+    xmlNodePtr          *nodes = NULL;
+    xmlNodePtr           oldNode = ctx->xpathContext;
+    int                  oldContextSize = ctx->xpathContextSize;
+    int                  oldProximityPosition = ctx->xpathProximityPosition;
+    xmlXPathObjectPtr    v;
+    xrltBool             ret = FALSE;
+    int                  i;
+    int                  j;
+
+    items = (xrltSortItem *)xmlMalloc(sizeof(xrltSortItem) * val->nodeNr);
+    keys = (xrltSortKey *)xmlMalloc(sizeof(xrltSortKey) * val->nodeNr *
+                                    comp->sortLen);
+    nodes = (xmlNodePtr *)xmlMalloc(sizeof(xmlNodePtr) * val->nodeNr);
+
+    if (items == NULL || keys == NULL || nodes == NULL) {
+        ERROR_OUT_OF_MEMORY(ctx, NULL, comp->node);
+        goto error;
+    }
+
+    memset(keys, 0, sizeof(xrltSortKey) * val->nodeNr * comp->sortLen);
+
+    ctx->xpathContextSize = val->nodeNr;
+
+    for (i = 0; i < val->nodeNr; i++) {
+        items[i].pos = i;
+        items[i].keys = keys + i * comp->sortLen;
+        items[i].comp = comp;
+
+        ctx->xpathContext = val->nodeTab[i];
+        ctx->xpathProximityPosition = i + 1;
+
+        for (j = 0; j < comp->sortLen; j++) {
+            if (!xrltXPathEval(ctx, insert, &comp->sort[j]->select, &v)) {
+                goto error;
+            }
+
+            if (v == NULL) {
+                *wait = ctx->xpathWait;
+                ret = TRUE;
+                goto error;
+            }
+
+            if (comp->sort[j]->number) {
+                items[i].keys[j].num = xmlXPathCastToNumber(v);
+            } else {
+                items[i].keys[j].str = xmlXPathCastToString(v);
+            }
+
+            xmlXPathFreeObject(v);
+
+            if (!comp->sort[j]->number && items[i].keys[j].str == NULL) {
+                ERROR_OUT_OF_MEMORY(ctx, NULL, comp->sort[j]->node);
+                goto error;
+            }
+        }
+    }
+
+    qsort(items, val->nodeNr, sizeof(xrltSortItem), xrltSortCompare);
+
+    memcpy(nodes, val->nodeTab, sizeof(xmlNodePtr) * val->nodeNr);
+
+    for (i = 0; i < val->nodeNr; i++) {
+        val->nodeTab[i] = nodes[items[i].pos];
+    }
+
+    ret = TRUE;
+
+  error:
+    ctx->xpathContext = oldNode;
+    ctx->xpathContextSize = oldContextSize;
+    ctx->xpathProximityPosition = oldProximityPosition;
+
+    if (keys != NULL) {
+        for (i = 0; i < val->nodeNr * comp->sortLen; i++) {
+            if (keys[i].str != NULL) { xmlFree(keys[i].str); }
+        }
+
+        xmlFree(keys);
+    }
+
+    if (items != NULL) { xmlFree(items); }
+    if (nodes != NULL) { xmlFree(nodes); }
+
+    return ret;
+}
+
+
+static xrltBool
+xrltForEachNumber(xrltContextPtr ctx, xmlNodePtr insert,
+                  xrltCompiledValue *val, int *ret, xmlNodePtr *wait)
+{
+    xmlXPathObjectPtr   v;
+    double              d;
+
+    switch (val->type) {
+        case XRLT_VALUE_INT:
+            *ret = val->intval;
+
+            break;
+
+        case XRLT_VALUE_XPATH:
+            if (!xrltXPathEval(ctx, insert, &val->xpathval, &v)) {
+                return FALSE;
+            }
+
+            if (v == NULL) {
+                *wait = ctx->xpathWait;
+
+                break;
+            }
+
+            d = floor(xmlXPathCastToNumber(v));
+
+            xmlXPathFreeObject(v);
+
+            *ret = xmlXPathIsNaN(d) || d < 0 ? 0 : (d > INT_MAX ? INT_MAX :
+                                                                  (int)d);
+
+            break;
+
+        case XRLT_VALUE_EMPTY:
+        case XRLT_VALUE_TEXT:
+        case XRLT_VALUE_NODELIST:
+            break;
+    }
+
+    return TRUE;
+}
+
+
+static xrltBool
+xrltForEachPrepare(xrltContextPtr ctx, xrltForEachData *comp,
+                   xmlNodePtr insert, xrltForEachTransformingData *tdata,
+                   xmlNodePtr *wait)
+{
+    // Only the items within offset and limit are transformed, position()
+    // and last() still refer to the whole (sorted) node-set.
+    int   offset = 0;
+    int   limit = INT_MAX;
+    int   len = tdata->val == NULL ? 0 : tdata->val->nodeNr;
+
+    *wait = NULL;
+
+    if (len > 0) {
+        if (!xrltForEachNumber(ctx, insert, &comp->offset, &offset, wait)) {
+            return FALSE;
+        }
+
+        if (*wait != NULL) { return TRUE; }
+
+        if (!xrltForEachNumber(ctx, insert, &comp->limit, &limit, wait)) {
+            return FALSE;
+        }
+
+        if (*wait != NULL) { return TRUE; }
+
+        if (comp->sortLen > 0 && offset < len && limit > 0 && len > 1) {
+            if (!xrltForEachSort(ctx, comp, insert, tdata->val, wait)) {
+                return FALSE;
+            }
+
+            if (*wait != NULL) { return TRUE; }
+        }
+    }
+
+    tdata->from = offset < len ? offset : len;
+    tdata->to = limit < len - tdata->from ? tdata->from + limit : len;
+    tdata->prepared = TRUE;
+
+    return TRUE;
+}
+
+
 static void
 xrltForEachTransformingFree(void *data)
 {
@@ -139,39 +578,78 @@ DEFINE_TRANSFORM_FUNCTION(
                 return xrltForEachTransform(ctx, comp, insert, tdata);
             }
         } else {
-            if (tdata->val != NULL && tdata->val->nodeNr > 0) {
-                if (tdata->retNode == NULL) {
-                    int   i;
-                    int   oldContextSize;
-                    int   oldProximityPosition;
+            if (!tdata->prepared) {
+                if (!xrltForEachPrepare(ctx, tcomp, insert, tdata, &tmpNode)) {
+                    return FALSE;
+                }
+
+                if (tmpNode != NULL) {
+                    WAIT_FOR_NODE(ctx, tmpNode, xrltForEachTransform);
+                    CALL_AGAIN(ctx, xrltForEachTransform);
+                }
+            }
 
+            if (tdata->from < tdata->to) {
+                if (tdata->retNode == NULL) {
                     NEW_CHILD(ctx, tdata->retNode, tdata->node, "r");
 
+                    tdata->cur = tdata->from;
+                }
+
+                if (tdata->cur < tdata->to) {
+                    int      i;
+                    int      to;
+                    int      oldContextSize;
+                    int      oldProximityPosition;
+                    size_t   oldVarScope;
+
+                    // Bodies that can run inline are run right away, a batch
+                    // per call to keep the budgets working. The others are
+                    // scheduled all at once.
+                    to = tcomp->inlined &&
+                         tdata->to - tdata->cur > XRLT_FOREACH_BATCH
+                        ?
+                        tdata->cur + XRLT_FOREACH_BATCH
+                        :
+                        tdata->to;
+
                     tmpNode = ctx->xpathContext;
                     oldContextSize = ctx->xpathContextSize;
                     oldProximityPosition = ctx->xpathProximityPosition;
+                    oldVarScope = ctx->varScope;
 
                     ctx->xpathContextSize = tdata->val->nodeNr;
 
-                    for (i = 0; i < tdata->val->nodeNr; i++) {
+                    for (i = tdata->cur; i < to; i++) {
                         ctx->varScope = ++ctx->maxVarScope;
 
                         ctx->xpathContext = tdata->val->nodeTab[i];
                         ctx->xpathProximityPosition = i + 1;
 
-                        TRANSFORM_SUBTREE(ctx, tcomp->children, tdata->retNode);
+                        if (tcomp->inlined) {
+                            if (!xrltElementTransformInline(ctx,
+                                                            tcomp->children,
+                                                            tdata->retNode))
+                            {
+                                return FALSE;
+                            }
+                        } else {
+                            TRANSFORM_SUBTREE(ctx, tcomp->children,
+                                              tdata->retNode);
+                        }
                     }
 
+                    tdata->cur = to;
+
                     ctx->xpathContext = tmpNode;
                     ctx->xpathContextSize = oldContextSize;
                     ctx->xpathProximityPosition = oldProximityPosition;
+                    ctx->varScope = oldVarScope;
 
-                    SCHEDULE_CALLBACK(ctx, &ctx->tcb, xrltForEachTransform,
-                                      comp, insert, data);
-                    return TRUE;
-                } else {
-                    WAIT_FOR_NODE(ctx, tdata->retNode, xrltForEachTransform);
+                    CALL_AGAIN(ctx, xrltForEachTransform);
                 }
+
+                WAIT_FOR_NODE(ctx, tdata->retNode, xrltForEachTransform);
             }
         }
     }
@@ -14,10 +14,23 @@ extern "C" {
 #endif
 
 
+typedef struct {
+    xmlNodePtr      node;
+    xrltXPathExpr   select;
+    xrltBool        descending;
+    xrltBool        number;
+} xrltSortData;
+
+
 typedef struct {
     xmlNodePtr          node;
     xrltCompiledValue   select;
+    xrltCompiledValue   offset;
+    xrltCompiledValue   limit;
+    xrltSortData      **sort;
+    int                 sortLen;
     xmlNodePtr          children;
+    xrltBool            inlined;
 } xrltForEachData;
 
 
@@ -26,6 +39,10 @@ typedef struct {
 
     xrltBool        xpathEvaluation;
     xmlNodeSetPtr   val;
+    xrltBool        prepared;
+    int             from;
+    int             to;
+    int             cur;
 } xrltForEachTransformingData;
 
 
@@ -38,6 +55,12 @@ xrltBool
         xrltForEachTransform   (xrltContextPtr ctx, void *comp,
                                 xmlNodePtr insert, void *data);
 
+void *
+        xrltSortCompile        (xrltRequestsheetPtr sheet, xmlNodePtr node,
+                                void *prevcomp);
+void
+        xrltSortFree           (void *comp);
+
 
 #ifdef __cplusplus
 }
@@ -122,6 +122,18 @@ xrltFunctionCompile(xrltRequestsheetPtr sheet, xmlNodePtr node, void *prevcomp)
         t = NULL;
     }
 
+    t = xmlGetProp(node, XRLT_ELEMENT_ATTR_PURE);
+    if (t != NULL) {
+        // Stringified XML and JSON go straight to the output, there is no
+        // result to keep for them.
+        ret->pure = xmlStrEqual(t, XRLT_VALUE_YES) &&
+                    ret->transformation != XRLT_TRANSFORMATION_JSON_STRINGIFY &&
+                    ret->transformation != XRLT_TRANSFORMATION_XML_STRINGIFY;
+
+        xmlFree(t);
+        t = NULL;
+    }
+
     // We keep the last function declaration as a function.
     xmlHashRemoveEntry3(table, ret->name, NULL, NULL, xrltFunctionRemove);
 
@@ -493,6 +505,8 @@ xrltApplyCompile(xrltRequestsheetPtr sheet, xmlNodePtr node, void *prevcomp)
             }
 
             for (i = 0; i < ret->func->paramLen; i++) {
+                newp[i]->applyParam = TRUE;
+
                 if (newp[i]->sync) {
                     ret->hasSyncParam = TRUE;
                 }
@@ -556,6 +570,29 @@ xrltApplyFree(void *comp)
 }
 
 
+static void
+xrltXSLTTaskFree(xrltXSLTTaskData *task)
+{
+    size_t   i;
+
+    if (task == NULL) { return; }
+
+    if (task->params != NULL) {
+        for (i = 0; task->params[i] != NULL; i += 2) {
+            xmlFree(task->params[i + 1]);
+        }
+
+        xmlFree(task->params);
+    }
+
+    if (task->copy != NULL) { xmlFreeDoc(task->copy); }
+    if (task->res != NULL) { xmlFreeDoc(task->res); }
+    if (task->str != NULL) { xmlFree(task->str); }
+
+    xmlFree(task);
+}
+
+
 static void
 xrltApplyTransformingFree(void *data)
 {
@@ -579,32 +616,47 @@ xrltApplyTransformingFree(void *data)
             }
         }
 
+        if (tdata->xslt != NULL) {
+            xrltXSLTTaskFree(tdata->xslt);
+        }
+
+        if (tdata->memo != NULL) { xmlFree(tdata->memo); }
+
         xmlFree(tdata);
     }
 }
 
 
-static inline xrltBool
-xrltXSLTTransform(xrltContextPtr ctx, xmlNodePtr src,
-                  xrltVariableDataPtr *param, size_t paramLen,
-                  xsltStylesheetPtr style, xmlDocPtr doc, xrltBool tostr,
-                  xmlNodePtr insert)
+static xrltXSLTTaskData *
+xrltXSLTTaskCreate(xrltContextPtr ctx, xmlNodePtr src,
+                   xrltVariableDataPtr *param, size_t paramLen,
+                   xsltStylesheetPtr style, xmlDocPtr doc, xrltBool tostr)
 {
-    xmlDocPtr                 res = NULL;
-    xmlChar                  *xsltResult;
-    int                       len;
-    xmlNodePtr                node;
-    size_t                    i;
-    xmlXPathObjectPtr         val;
-    xmlChar                  *pval;
-    size_t                    paramIndex;
-    char                    **applyParams = NULL;
-    xsltTransformContextPtr   xctx;
-    xrltBool                  ret = FALSE;
+    xrltXSLTTaskData   *task;
+    size_t              i;
+    xmlXPathObjectPtr   val;
+    xmlChar            *pval;
+    size_t              paramIndex;
+
+    XRLT_MALLOC(ctx, NULL, src, task, xrltXSLTTaskData *,
+                sizeof(xrltXSLTTaskData), NULL);
+
+    task->src = src;
+    task->style = style;
+    task->doc = doc;
+    task->tostr = tostr;
 
     if (paramLen > 0) {
-        XRLT_MALLOC(ctx, NULL, src, applyParams, char **,
-                    sizeof(char *) * (paramLen + paramLen + 1), FALSE);
+        task->params = (char **)xmlMalloc(
+            sizeof(char *) * (paramLen + paramLen + 1)
+        );
+
+        if (task->params == NULL) {
+            ERROR_OUT_OF_MEMORY(ctx, NULL, src);
+            goto error;
+        }
+
+        memset(task->params, 0, sizeof(char *) * (paramLen + paramLen + 1));
 
         paramIndex = 0;
 
@@ -628,95 +680,248 @@ xrltXSLTTransform(xrltContextPtr ctx, xmlNodePtr src,
             }
 
             if (xmlStrlen(pval) > 0) {
-                applyParams[paramIndex++] = (char *)param[i]->name;
-                applyParams[paramIndex] = (char *)pval;
-                paramIndex++;
+                task->params[paramIndex++] = (char *)param[i]->name;
+                task->params[paramIndex++] = (char *)pval;
             } else {
                 xmlFree(pval);
             }
         }
+    }
+
+    return task;
 
-        if (paramIndex == 0) {
-            xmlFree(applyParams);
-            applyParams = NULL;
+  error:
+    xrltXSLTTaskFree(task);
+
+    return NULL;
+}
+
+
+static xrltBool
+xrltXSLTTaskDetach(xrltContextPtr ctx, xrltXSLTTaskData *task)
+{
+    // Offloaded task runs while the context goes on, so it gets a copy of
+    // the document with a dictionary of its own. The context doesn't touch
+    // the copy until the task is reported done.
+    xmlDocPtr    doc;
+    xmlNodePtr   node;
+
+    doc = xmlNewDoc(NULL);
+
+    if (doc == NULL) {
+        ERROR_CREATE_NODE(ctx, NULL, task->src);
+        return FALSE;
+    }
+
+    task->copy = doc;
+
+    doc->dict = xmlDictCreate();
+
+    if (doc->dict == NULL) {
+        ERROR_OUT_OF_MEMORY(ctx, NULL, task->src);
+        return FALSE;
+    }
+
+    if (task->doc->children != NULL) {
+        node = xmlDocCopyNodeList(doc, task->doc->children);
+
+        if (node == NULL) {
+            ERROR_CREATE_NODE(ctx, NULL, task->src);
+            return FALSE;
+        }
+
+        if (xmlAddChildList((xmlNodePtr)doc, node) == NULL) {
+            ERROR_ADD_NODE(ctx, NULL, task->src);
+
+            xmlFreeNodeList(node);
+
+            return FALSE;
         }
     }
 
-    xctx = xsltNewTransformContext(style, doc);
+    task->doc = doc;
+
+    return TRUE;
+}
+
+
+static void
+xrltXSLTTaskRun(void *data)
+{
+    // This one is called from a thread pool when the context is offloading
+    // XSLT transformations. It shouldn't touch anything but the task.
+    xrltXSLTTaskData          *task = (xrltXSLTTaskData *)data;
+    xsltTransformContextPtr    xctx;
+    size_t                     started = xrltTimeNanoseconds();
+
+    xctx = xsltNewTransformContext(task->style, task->doc);
 
     if (xctx != NULL) {
-        xsltQuoteUserParams(xctx, (const char **)applyParams);
-        res = xsltApplyStylesheetUser(style, doc, 0, 0, 0, xctx);
+        xsltQuoteUserParams(xctx, (const char **)task->params);
+        task->res = xsltApplyStylesheetUser(task->style, task->doc, 0, 0, 0,
+                                            xctx);
         xsltFreeTransformContext(xctx);
     }
 
-    if (res == NULL) {
-        xrltTransformError(ctx, NULL, src,
-                           "XSLT transformation failed\n");
-        goto error;
-    }
+    if (task->res != NULL) {
+        task->applied = TRUE;
 
-    if (tostr) {
-        if (xsltSaveResultToString(&xsltResult, &len, res, style) == 0) {
-            node = xmlNewTextLen(xsltResult, len);
+        if (task->tostr) {
+            task->stringified = xsltSaveResultToString(&task->str, &task->len,
+                                                       task->res,
+                                                       task->style) == 0;
 
-            xmlFree(xsltResult);
+            xmlFreeDoc(task->res);
+            task->res = NULL;
+        }
+    }
 
-            if (node == NULL) {
-                ERROR_CREATE_NODE(ctx, NULL, src);
+    task->time = xrltTimeNanoseconds() - started;
+}
 
-                goto error;
-            }
 
-            if (xmlAddChild(insert, node) == NULL) {
-                ERROR_ADD_NODE(ctx, NULL, src);
+static xrltBool
+xrltXSLTTaskInsert(xrltContextPtr ctx, xrltXSLTTaskData *task,
+                   xmlNodePtr insert)
+{
+    xmlNodePtr   node;
 
-                xmlFreeNode(node);
+    if (!task->applied) {
+        xrltTransformError(ctx, NULL, task->src,
+                           "XSLT transformation failed\n");
+        return FALSE;
+    }
 
-                goto error;
-            }
-        } else {
-            xrltTransformError(ctx, NULL, src,
+    if (task->tostr) {
+        if (!task->stringified) {
+            xrltTransformError(ctx, NULL, task->src,
                                "Failed to stringify XSLT result\n");
-            goto error;
+            return FALSE;
         }
-    } else if (res->children != NULL) {
-        node = xmlDocCopyNodeList(insert->doc, res->children);
+
+        node = xmlNewTextLen(task->str, task->len);
 
         if (node == NULL) {
-            ERROR_CREATE_NODE(ctx, NULL, src);
+            ERROR_CREATE_NODE(ctx, NULL, task->src);
+            return FALSE;
+        }
 
-            goto error;
+        if (xmlAddChild(insert, node) == NULL) {
+            ERROR_ADD_NODE(ctx, NULL, task->src);
+
+            xmlFreeNode(node);
+
+            return FALSE;
+        }
+    } else if (task->res->children != NULL) {
+        node = xmlDocCopyNodeList(insert->doc, task->res->children);
+
+        if (node == NULL) {
+            ERROR_CREATE_NODE(ctx, NULL, task->src);
+            return FALSE;
         }
 
         if (xmlAddChildList(insert, node) == NULL) {
-            ERROR_ADD_NODE(ctx, NULL, src);
+            ERROR_ADD_NODE(ctx, NULL, task->src);
 
             xmlFreeNodeList(node);
 
-            goto error;
+            return FALSE;
         }
     }
 
-    ret = TRUE;
+    return TRUE;
+}
 
-  error:
-    if (res != NULL) { xmlFreeDoc(res); }
 
-    if (applyParams != NULL) {
-        paramIndex = 1;
+static xrltBool
+xrltXSLTInputFunc(xrltContextPtr ctx, xrltTransformValue *val, void *payload)
+{
+    xrltApplyTransformingData  *tdata = (xrltApplyTransformingData *)payload;
+    xrltXSLTTaskData           *task;
+    xrltBool                    ret;
 
-        for (i = 0; i < paramLen; i++) {
-            if (applyParams[paramIndex] != NULL) {
-                xmlFree(applyParams[paramIndex++]);
-                paramIndex++;
-            }
-        }
+    if (tdata == NULL || tdata->xslt == NULL) { return FALSE; }
+
+    task = tdata->xslt;
 
-        xmlFree(applyParams);
+    if (val->type != XRLT_TRANSFORM_VALUE_TASK) {
+        xrltTransformError(ctx, NULL, task->src, "Unexpected input\n");
+        return FALSE;
     }
 
-    return ret;
+    tdata->xslt = NULL;
+
+    ctx->xsltTime += task->time;
+
+    ret = xrltXSLTTaskInsert(ctx, task, tdata->retNode);
+
+    xrltXSLTTaskFree(task);
+
+    if (!ret) { return FALSE; }
+
+    xrltTraceSpan(ctx, "xslt", tdata->traceName, tdata->traceId,
+                  tdata->started, NULL);
+
+    COUNTER_DECREASE(ctx, tdata->retNode);
+
+    return TRUE;
+}
+
+
+static inline xrltBool
+xrltXSLTTransform(xrltContextPtr ctx, xrltApplyData *acomp,
+                  xrltApplyTransformingData *tdata, xrltBool tostr)
+{
+    xrltXSLTTaskData  *task;
+    xrltBool           ret;
+    size_t             id;
+    size_t             started = TRACE_START(ctx);
+
+    task = xrltXSLTTaskCreate(ctx, acomp->node, acomp->param, acomp->paramLen,
+                              acomp->func->xslt, tdata->self, tostr);
+
+    if (task == NULL) { return FALSE; }
+
+    if (!ctx->offload) {
+        xrltXSLTTaskRun(task);
+
+        ctx->xsltTime += task->time;
+
+        ret = xrltXSLTTaskInsert(ctx, task, tdata->retNode);
+
+        xrltXSLTTaskFree(task);
+
+        xrltTraceSpan(ctx, "xslt", acomp->func->name, 0, started, NULL);
+
+        return ret;
+    }
+
+    // The caller will run the task (probably, in another thread) and let us
+    // know with XRLT_TRANSFORM_VALUE_TASK, the result node is not ready
+    // until then.
+    tdata->xslt = task;
+
+    if (!xrltXSLTTaskDetach(ctx, task)) { return FALSE; }
+
+    id = xrltInputSubscribe(ctx, xrltXSLTInputFunc, tdata);
+
+    if (id == 0) { return FALSE; }
+
+    if (!xrltTaskListPush(&ctx->task, id, xrltXSLTTaskRun, task)) {
+        ERROR_OUT_OF_MEMORY(ctx, NULL, acomp->node);
+        return FALSE;
+    }
+
+    COUNTER_INCREASE(ctx, tdata->retNode);
+
+    ctx->cur |= XRLT_STATUS_TASK;
+
+    tdata->traceName = acomp->func->name;
+    tdata->traceId = id;
+    tdata->started = started;
+
+    return TRUE;
 }
 
 
@@ -878,6 +1083,278 @@ xrltQuerystringParse(xrltContextPtr ctx, xmlNodePtr src,
 }
 
 
+static xrltBool
+xrltApplyMemoKeyAdd(xrltContextPtr ctx, xmlNodePtr insert,
+                    xrltCompiledValue *val, xmlBufferPtr buf, xmlBufferPtr tmp,
+                    xrltBool *ready)
+{
+    xmlXPathObjectPtr   v;
+    xmlNodeSetPtr       ns;
+    xmlChar            *s;
+    char                num[32];
+    int                 i;
+
+    xmlBufferEmpty(tmp);
+
+    switch (val->type) {
+        case XRLT_VALUE_EMPTY:
+            xmlBufferCCat(buf, "e");
+            break;
+
+        case XRLT_VALUE_TEXT:
+            xmlBufferCCat(buf, "t");
+            xmlBufferCat(tmp, val->textval);
+            break;
+
+        case XRLT_VALUE_XPATH:
+            if (!xrltXPathEval(ctx, insert, &val->xpathval, &v)) {
+                return FALSE;
+            }
+
+            if (v == NULL) {
+                // Some variables are not ready, the call goes as usual.
+                *ready = FALSE;
+                return TRUE;
+            }
+
+            if (v->type == XPATH_NODESET) {
+                // Node-sets are compared by their markup.
+                xmlBufferCCat(buf, "x");
+
+                ns = v->nodesetval;
+
+                for (i = 0; ns != NULL && i < ns->nodeNr; i++) {
+                    if (ns->nodeTab[i]->type == XML_NAMESPACE_DECL ||
+                        xmlNodeDump(tmp, ns->nodeTab[i]->doc, ns->nodeTab[i],
+                                    0, 0) < 0)
+                    {
+                        *ready = FALSE;
+                        break;
+                    }
+                }
+            } else {
+                s = xmlXPathCastToString(v);
+
+                if (s == NULL) {
+                    xmlXPathFreeObject(v);
+                    ERROR_OUT_OF_MEMORY(ctx, NULL, val->xpathval.src);
+                    return FALSE;
+                }
+
+                // Scalars are typed, "1" and 1 are different arguments.
+                snprintf(num, sizeof(num), "%d", v->type);
+                xmlBufferCCat(buf, num);
+                xmlBufferCat(tmp, s);
+
+                xmlFree(s);
+            }
+
+            xmlXPathFreeObject(v);
+
+            break;
+
+        case XRLT_VALUE_NODELIST:
+        case XRLT_VALUE_INT:
+            *ready = FALSE;
+            return TRUE;
+    }
+
+    snprintf(num, sizeof(num), "%d:", xmlBufferLength(tmp));
+    xmlBufferCCat(buf, num);
+    xmlBufferAdd(buf, xmlBufferContent(tmp), xmlBufferLength(tmp));
+    xmlBufferCCat(buf, "\n");
+
+    return TRUE;
+}
+
+
+static xrltBool
+xrltApplyMemoKey(xrltContextPtr ctx, xrltApplyData *acomp, xmlNodePtr insert,
+                 xmlChar **key)
+{
+    // The key is the function and the values of the parameters passed to
+    // it, NULL when some of the values are not known yet.
+    xmlBufferPtr   buf, tmp;
+    xrltBool       ready = TRUE;
+    xrltBool       ret = TRUE;
+    char           id[32];
+    size_t         i;
+
+    *key = NULL;
+
+    buf = xmlBufferCreate();
+    tmp = xmlBufferCreate();
+
+    if (buf == NULL || tmp == NULL) {
+        ERROR_OUT_OF_MEMORY(ctx, NULL, acomp->node);
+        ret = FALSE;
+        goto done;
+    }
+
+    snprintf(id, sizeof(id), "%p\n", (void *)acomp->func);
+    xmlBufferCCat(buf, id);
+
+    if (acomp->transform) {
+        xmlBufferCCat(buf, ".");
+
+        if (!xrltApplyMemoKeyAdd(ctx, insert, &acomp->self, buf, tmp, &ready))
+        {
+            ret = FALSE;
+            goto done;
+        }
+    }
+
+    for (i = 0; i < acomp->paramLen && ready; i++) {
+        // Defaults of the function are the same for every call.
+        if (acomp->param[i]->node->parent != acomp->node) { continue; }
+
+        xmlBufferCat(buf, acomp->param[i]->name);
+        xmlBufferCCat(buf, "=");
+
+        if (!xrltApplyMemoKeyAdd(ctx, insert, &acomp->param[i]->val, buf, tmp,
+                                 &ready))
+        {
+            ret = FALSE;
+            goto done;
+        }
+    }
+
+    if (ready) {
+        *key = xmlStrndup(xmlBufferContent(buf), xmlBufferLength(buf));
+
+        if (*key == NULL) {
+            ERROR_OUT_OF_MEMORY(ctx, NULL, acomp->node);
+            ret = FALSE;
+        }
+    }
+
+  done:
+    if (buf != NULL) { xmlBufferFree(buf); }
+    if (tmp != NULL) { xmlBufferFree(tmp); }
+
+    return ret;
+}
+
+
+static xrltBool
+xrltApplyMemoCopy(xmlNodePtr first, xmlNodePtr parent)
+{
+    xrltNodeDataPtr   n;
+    xmlNodePtr        node;
+    xrltBool          deep;
+
+    for (; first != NULL; first = first->next) {
+        n = (xrltNodeDataPtr)first->_private;
+
+        // The result keeps the referred nodes themselves, their documents
+        // might be released before the next call.
+        if (n != NULL && n->free == xrltReferenceFree) {
+            node = xmlDocCopyNode((xmlNodePtr)n->data, parent->doc, 1);
+            deep = FALSE;
+        } else {
+            deep = first->type == XML_ELEMENT_NODE;
+            node = xmlDocCopyNode(first, parent->doc, deep ? 2 : 1);
+        }
+
+        if (node == NULL) { return FALSE; }
+
+        if (xmlAddChild(parent, node) == NULL) {
+            xmlFreeNode(node);
+            return FALSE;
+        }
+
+        if (deep && !xrltApplyMemoCopy(first->children, node)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+static xrltBool
+xrltApplyMemoStore(xrltContextPtr ctx, xrltApplyData *acomp,
+                   xrltApplyTransformingData *tdata)
+{
+    xmlDocPtr   doc;
+
+    if (ctx->memo == NULL) {
+        ctx->memo = xmlHashCreate(20);
+
+        if (ctx->memo == NULL) {
+            ERROR_OUT_OF_MEMORY(ctx, NULL, acomp->node);
+            return FALSE;
+        }
+    }
+
+    // The same call might have been finished in the meantime.
+    if (xmlHashLookup(ctx->memo, tdata->memo) != NULL) { return TRUE; }
+
+    doc = xrltDocCreate(ctx);
+
+    if (doc == NULL) {
+        ERROR_CREATE_NODE(ctx, NULL, acomp->node);
+        return FALSE;
+    }
+
+    if (xmlAddChild(ctx->var, (xmlNodePtr)doc) == NULL) {
+        ERROR_ADD_NODE(ctx, NULL, acomp->node);
+        xmlFreeDoc(doc);
+        return FALSE;
+    }
+
+    doc->doc = doc;
+
+    if (!xrltApplyMemoCopy(tdata->retNode->children, (xmlNodePtr)doc)) {
+        ERROR_CREATE_NODE(ctx, NULL, acomp->node);
+        return FALSE;
+    }
+
+    if (xmlHashAddEntry(ctx->memo, tdata->memo, doc)) {
+        xrltTransformError(ctx, NULL, acomp->node, "Failed to keep result\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+static xrltBool
+xrltApplyMemoInsert(xrltContextPtr ctx, xrltApplyData *acomp,
+                    xmlNodePtr insert, xmlDocPtr doc)
+{
+    xmlNodePtr   node, copy;
+
+    for (node = doc->children; node != NULL; node = node->next) {
+        if (insert->doc == ctx->responseDoc &&
+            (node->type == XML_ELEMENT_NODE || node->type == XML_TEXT_NODE ||
+             node->type == XML_CDATA_SECTION_NODE))
+        {
+            if (!xrltAddReference(ctx, acomp->node, insert, node)) {
+                return FALSE;
+            }
+
+            continue;
+        }
+
+        copy = xmlDocCopyNode(node, insert->doc, 1);
+
+        if (copy == NULL) {
+            ERROR_CREATE_NODE(ctx, NULL, acomp->node);
+            return FALSE;
+        }
+
+        if (xmlAddChild(insert, copy) == NULL) {
+            ERROR_ADD_NODE(ctx, NULL, acomp->node);
+            xmlFreeNode(copy);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
 xrltBool
 xrltApplyTransform(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
                    void *data)
@@ -890,19 +1367,47 @@ xrltApplyTransform(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
     xrltApplyTransformingData  *tdata;
     size_t                      i;
     size_t                      newScope;
+    xmlChar                    *key = NULL;
+    xmlDocPtr                   doc;
 
     if (data == NULL) {
-        NEW_CHILD(ctx, node, insert, "a");
+        if (acomp->func->pure) {
+            if (!xrltApplyMemoKey(ctx, acomp, insert, &key)) {
+                return FALSE;
+            }
+
+            doc = key != NULL && ctx->memo != NULL
+                ? (xmlDocPtr)xmlHashLookup(ctx->memo, key)
+                : NULL;
+
+            if (doc != NULL) {
+                xmlFree(key);
+
+                return xrltApplyMemoInsert(ctx, acomp, insert, doc);
+            }
+        }
+
+        NEW_CHILD_GOTO(ctx, node, insert, "a");
 
-        ASSERT_NODE_DATA(node, n);
+        ASSERT_NODE_DATA_GOTO(node, n);
 
-        XRLT_MALLOC(ctx, NULL, acomp->node, tdata, xrltApplyTransformingData*,
-                    sizeof(xrltApplyTransformingData), FALSE);
+        tdata = (xrltApplyTransformingData *)xmlMalloc(
+            sizeof(xrltApplyTransformingData)
+        );
+
+        if (tdata == NULL) {
+            ERROR_OUT_OF_MEMORY(ctx, NULL, acomp->node);
+            goto error;
+        }
+
+        memset(tdata, 0, sizeof(xrltApplyTransformingData));
 
         n->data = tdata;
         n->free = xrltApplyTransformingFree;
 
         tdata->node = node;
+        tdata->memo = key;
+        key = NULL;
 
         if (acomp->hasSyncParam) {
             NEW_CHILD(ctx, tdata->paramNode, node, "p");
@@ -914,7 +1419,7 @@ xrltApplyTransform(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
         node = ctx->var;
 
         for (i = 0; i < acomp->paramLen; i++) {
-            acomp->param[i]->declScopePos = newScope;
+            ctx->applyScope = newScope;
 
             ctx->var = acomp->param[i]->sync ? tdata->paramNode : node;
 
@@ -928,7 +1433,7 @@ xrltApplyTransform(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
         COUNTER_INCREASE(ctx, tdata->node);
 
         if (acomp->func->transformation != XRLT_TRANSFORMATION_FUNCTION) {
-            tdata->self = xmlNewDoc(NULL);
+            tdata->self = xrltDocCreate(ctx);
 
             if (tdata->self == NULL) {
                 ERROR_CREATE_NODE(ctx, NULL, acomp->node);
@@ -1025,26 +1530,14 @@ xrltApplyTransform(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
                             break;
 
                         case XRLT_TRANSFORMATION_XSLT_STRINGIFY:
-                            if (!xrltXSLTTransform(ctx, acomp->node,
-                                                   acomp->param,
-                                                   acomp->paramLen,
-                                                   acomp->func->xslt,
-                                                   tdata->self, TRUE,
-                                                   tdata->retNode))
-                            {
+                            if (!xrltXSLTTransform(ctx, acomp, tdata, TRUE)) {
                                 return FALSE;
                             }
 
                             break;
 
                         case XRLT_TRANSFORMATION_XSLT:
-                            if (!xrltXSLTTransform(ctx, acomp->node,
-                                                   acomp->param,
-                                                   acomp->paramLen,
-                                                   acomp->func->xslt,
-                                                   tdata->self, FALSE,
-                                                   tdata->retNode))
-                            {
+                            if (!xrltXSLTTransform(ctx, acomp, tdata, FALSE)) {
                                 return FALSE;
                             }
 
@@ -1127,6 +1620,8 @@ xrltApplyTransform(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
 
             if (acomp->func->js) {
 #ifndef __XRLT_NO_JAVASCRIPT__
+                size_t   started = xrltTimeNanoseconds();
+
                 ctx->varContext = acomp->func->node;
 
                 if (!xrltJSApply(ctx, acomp->func->node, acomp->func->name,
@@ -1134,6 +1629,10 @@ xrltApplyTransform(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
                 {
                     return FALSE;
                 }
+
+                ctx->jsTime += xrltTimeNanoseconds() - started;
+
+                xrltTraceSpan(ctx, "js", acomp->func->name, 0, started, NULL);
 #endif
             } else {
                 if (n->count > 0) {
@@ -1156,10 +1655,19 @@ xrltApplyTransform(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
             }
         }
 
+        if (tdata->memo != NULL && !xrltApplyMemoStore(ctx, acomp, tdata)) {
+            return FALSE;
+        }
+
         REPLACE_RESPONSE_NODE(
             ctx, tdata->node, tdata->retNode->children, acomp->node
         );
     }
 
     return TRUE;
+
+  error:
+    if (key != NULL) { xmlFree(key); }
+
+    return FALSE;
 }
@@ -49,6 +49,9 @@ typedef struct {
     xmlNodePtr               children;
 
     xsltStylesheetPtr        xslt;
+
+    xrltBool                 pure;  // The result depends on the arguments
+                                    // only and is reused for the same ones.
 } xrltFunctionData;
 
 
@@ -76,11 +79,37 @@ typedef struct {
 
 
 typedef struct {
-    xmlNodePtr   node;
-    xmlNodePtr   paramNode;
-    xmlNodePtr   retNode;
-    xmlDocPtr    self;
-    xrltBool     finalize;
+    xmlNodePtr          src;
+    xsltStylesheetPtr   style;
+    xmlDocPtr           doc;
+    xmlDocPtr           copy;       // Detached copy of the document for an
+                                    // offloaded task, owned by the task.
+    char              **params;
+    xrltBool            tostr;
+
+    xrltBool            applied;
+    xmlDocPtr           res;
+    xrltBool            stringified;
+    xmlChar            *str;
+    int                 len;
+    size_t              time;       // Nanoseconds the transformation took.
+} xrltXSLTTaskData;
+
+
+typedef struct {
+    xmlNodePtr          node;
+    xmlNodePtr          paramNode;
+    xmlNodePtr          retNode;
+    xmlDocPtr           self;
+    xrltBool            finalize;
+    xrltXSLTTaskData   *xslt;       // XSLT transformation being run by the
+                                    // caller (when the context offloads
+                                    // them).
+    xmlChar            *traceName;  // Function name, task id and start
+    size_t              traceId;    // time of the offloaded XSLT
+    size_t              started;    // transformation (for tracing).
+    xmlChar            *memo;       // Key to keep the result by (pure
+                                    // functions).
 } xrltApplyTransformingData;
 
 
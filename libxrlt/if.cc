@@ -24,18 +24,15 @@ xrltIfCompile(xrltRequestsheetPtr sheet, xmlNodePtr node, void *prevcomp)
 
     ret->node = node;
 
-    ret->test.xpathval.expr = xmlXPathCompile(expr);
-    ret->test.type = XRLT_VALUE_XPATH;
-
-    ret->test.xpathval.src = node;
-    ret->test.xpathval.scope = node->parent;
-
-    if (ret->test.xpathval.expr == NULL) {
+    if (!xrltXPathCompileTest(sheet, expr, &ret->test)) {
         xrltTransformError(NULL, sheet, node,
                            "Failed to compile expression\n");
         goto error;
     }
 
+    ret->test.xpathval.src = node;
+    ret->test.xpathval.scope = node->parent;
+
     xmlFree(expr);
 
     ret->children = node->children;
@@ -54,7 +51,7 @@ void
 xrltIfFree(void *comp)
 {
     if (comp != NULL) {
-        xmlXPathFreeCompExpr(((xrltIfData *)comp)->test.xpathval.expr);
+        CLEAR_XRLT_VALUE(((xrltIfData *)comp)->test);
         xmlFree(comp);
     }
 }
@@ -68,21 +65,29 @@ static void xrltIfTransformingFree(void *data)
 }
 
 
-DEFINE_TRANSFORM_FUNCTION(
-    xrltIfTransform,
+static DEFINE_TRANSFORM_FUNCTION(
+    xrltIfTestTransform,
     xrltIfData*,
     xrltIfTransformingData*,
     sizeof(xrltIfTransformingData),
     xrltIfTransformingFree,
     ;,
     {
-        NEW_CHILD(ctx, tdata->testNode, tdata->node, "t");
+        if (tcomp->test.type == XRLT_VALUE_INT) {
+            // Known to be true since the compilation.
+            NEW_CHILD(ctx, tdata->retNode, tdata->node, "r");
 
-        TRANSFORM_TO_BOOLEAN(ctx, tdata->testNode, &tcomp->test, &tdata->test);
+            TRANSFORM_SUBTREE(ctx, tcomp->children, tdata->retNode);
+        } else {
+            NEW_CHILD(ctx, tdata->testNode, tdata->node, "t");
+
+            TRANSFORM_TO_BOOLEAN(ctx, tdata->testNode, &tcomp->test,
+                                 &tdata->test);
+        }
     },
     {
         if (tdata->testNode != NULL) {
-            WAIT_FOR_NODE(ctx, tdata->testNode, xrltIfTransform);
+            WAIT_FOR_NODE(ctx, tdata->testNode, xrltIfTestTransform);
 
             tdata->testNode = NULL;
 
@@ -91,12 +96,28 @@ DEFINE_TRANSFORM_FUNCTION(
 
                 TRANSFORM_SUBTREE(ctx, tcomp->children, tdata->retNode);
 
-                CALL_AGAIN(ctx, xrltIfTransform);
+                CALL_AGAIN(ctx, xrltIfTestTransform);
             }
         }
 
         if (tdata->retNode != NULL) {
-            WAIT_FOR_NODE(ctx, tdata->retNode, xrltIfTransform);
+            WAIT_FOR_NODE(ctx, tdata->retNode, xrltIfTestTransform);
         }
     }
 );
+
+
+xrltBool
+xrltIfTransform(xrltContextPtr ctx, void *comp, xmlNodePtr insert, void *data)
+{
+    xrltIfData  *icomp = (xrltIfData *)comp;
+
+    // Nothing at all for the tests known to be false.
+    if (data == NULL && icomp != NULL && icomp->test.type == XRLT_VALUE_INT &&
+        !icomp->test.intval)
+    {
+        return TRUE;
+    }
+
+    return xrltIfTestTransform(ctx, comp, insert, data);
+}
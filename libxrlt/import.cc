@@ -7,15 +7,42 @@
 #include <libxml/uri.h>
 
 
+static void
+xrltImportSetURL(xmlNodePtr src, xmlNodePtr copy, const xmlChar *url)
+{
+    // The copies belong to the main requestsheet document, remember where
+    // they come from. Nodes of nested imports keep their own file. Line
+    // numbers are copied for elements only, the rest get them here.
+    xrltNodeDataPtr   s = (xrltNodeDataPtr)src->_private;
+    xrltNodeDataPtr   c = (xrltNodeDataPtr)copy->_private;
+
+    if (c != NULL) {
+        c->url = s != NULL && s->url != NULL ? s->url : url;
+    }
+
+    if (copy->line == 0) {
+        copy->line = src->line;
+    }
+
+    for (src = src->children, copy = copy->children;
+         src != NULL && copy != NULL;
+         src = src->next, copy = copy->next)
+    {
+        xrltImportSetURL(src, copy, url);
+    }
+}
+
+
 static inline xrltBool
 xrltProcessImport(xrltRequestsheetPtr sheet, xmlNodePtr node, int level)
 {
-    xmlChar    *base = NULL;
-    xmlChar    *href = NULL;
-    xmlChar    *URI = NULL;
-    xmlDocPtr   doc = NULL;
-    xmlNodePtr  n1, n2, n3;
-    xrltBool    ret = FALSE;
+    xmlChar          *base = NULL;
+    xmlChar          *href = NULL;
+    xmlChar          *URI = NULL;
+    xmlDocPtr         doc = NULL;
+    xmlNodePtr        n1, n2, n3;
+    const xmlChar    *url;
+    xrltBool          ret = FALSE;
 
     href = xmlGetNsProp(node, (const xmlChar *)"href", NULL);
     if (href == NULL) {
@@ -53,6 +80,12 @@ xrltProcessImport(xrltRequestsheetPtr sheet, xmlNodePtr node, int level)
         goto error;
     }
 
+    url = xmlDictLookup(sheet->dict, URI, -1);
+    if (url == NULL) {
+        ERROR_OUT_OF_MEMORY(NULL, sheet, node);
+        goto error;
+    }
+
     n1 = n1->children;
     n3 = node;
 
@@ -65,6 +98,8 @@ xrltProcessImport(xrltRequestsheetPtr sheet, xmlNodePtr node, int level)
 
         xmlReconciliateNs(node->doc, n2);
 
+        xrltImportSetURL(n1, n2, url);
+
         n3 = xmlAddNextSibling(n3, n2);
         if (n3 == NULL) {
             ERROR_ADD_NODE(NULL, sheet, n1);
@@ -489,6 +489,19 @@ xrltIncludeFree(void *comp)
 }
 
 
+static void
+xrltIncludeParseTaskFree(xrltIncludeParseTaskData *task)
+{
+    if (task == NULL) { return; }
+
+    if (task->href != NULL) { xmlFree(task->href); }
+    if (task->buf != NULL) { xmlBufferFree(task->buf); }
+    if (task->doc != NULL) { xmlFreeDoc(task->doc); }
+
+    xmlFree(task);
+}
+
+
 void
 xrltIncludeTransformingFree(void *data)
 {
@@ -523,6 +536,10 @@ xrltIncludeTransformingFree(void *data)
 
         if (tdata->doc != NULL) { xmlFreeDoc(tdata->doc); }
 
+        if (tdata->buf != NULL) { xmlBufferFree(tdata->buf); }
+
+        if (tdata->parse != NULL) { xrltIncludeParseTaskFree(tdata->parse); }
+
         for (i = 0; i < tdata->headerCount; i++) {
             if (tdata->header[i].cbody != NULL) {
                 xmlFree(tdata->header[i].cbody);
@@ -609,9 +626,24 @@ xrltProcessHeader(xrltContextPtr ctx, xrltTransformValue *val,
 }
 
 
+static inline void
+xrltIncludeSetResultStage(xrltIncludeTransformingData *data)
+{
+    if (data->comp->successTest.type == XRLT_VALUE_XPATH) {
+        data->stage = XRLT_INCLUDE_TRANSFORM_SUCCESS_TEST_BEGIN;
+    } else {
+        data->stage = data->status >= 200 && data->status < 400 ?
+            XRLT_INCLUDE_TRANSFORM_SUCCESS
+            :
+            XRLT_INCLUDE_TRANSFORM_FAILURE;
+    }
+}
+
+
 static inline xrltProcessInputResult
-xrltProcessBody(xrltContextPtr ctx, xrltTransformValueSubrequestBody *val,
-                xrltIncludeTransformingData *data)
+xrltProcessBodyChunk(xrltContextPtr ctx,
+                     xrltTransformValueSubrequestBody *val,
+                     xrltIncludeTransformingData *data)
 {
     xmlNodePtr   tmp;
 
@@ -620,7 +652,7 @@ xrltProcessBody(xrltContextPtr ctx, xrltTransformValueSubrequestBody *val,
 
         if (data->type != XRLT_SUBREQUEST_DATA_XML) {
             // XRLT_SUBREQUEST_DATA_XML type will use the doc from xmlparser.
-            data->doc = xmlNewDoc(NULL);
+            data->doc = xrltDocCreate(ctx);
 
             if (data->doc == NULL) {
                 ERROR_CREATE_NODE(ctx, NULL, data->srcNode);
@@ -642,6 +674,23 @@ xrltProcessBody(xrltContextPtr ctx, xrltTransformValueSubrequestBody *val,
                     return XRLT_PROCESS_INPUT_ERROR;
                 }
 
+                // The result goes to the response, so it shares the names
+                // with it. The parser compares its predefined names by
+                // pointer, they should come from the new dictionary too.
+                xmlDictFree(data->xmlparser->dict);
+                data->xmlparser->dict = ctx->dict;
+                xmlDictReference(ctx->dict);
+
+                data->xmlparser->str_xml = xmlDictLookup(
+                    ctx->dict, (const xmlChar *)"xml", 3
+                );
+                data->xmlparser->str_xmlns = xmlDictLookup(
+                    ctx->dict, (const xmlChar *)"xmlns", 5
+                );
+                data->xmlparser->str_xml_ns = xmlDictLookup(
+                    ctx->dict, XML_XML_NAMESPACE, 36
+                );
+
                 if (val->last) {
                     if (xmlParseChunk(data->xmlparser,
                                       val->val.data, 0, 1) != 0)
@@ -758,27 +807,13 @@ xrltProcessBody(xrltContextPtr ctx, xrltTransformValueSubrequestBody *val,
             if (data->xmlparser->wellFormed == 0) {
                 data->stage = XRLT_INCLUDE_TRANSFORM_FAILURE;
             } else {
-                if (data->comp->successTest.type == XRLT_VALUE_XPATH) {
-                    data->stage = XRLT_INCLUDE_TRANSFORM_SUCCESS_TEST_BEGIN;
-                } else {
-                    data->stage = data->status >= 200 && data->status < 400 ?
-                        XRLT_INCLUDE_TRANSFORM_SUCCESS
-                        :
-                        XRLT_INCLUDE_TRANSFORM_FAILURE;
-                }
+                xrltIncludeSetResultStage(data);
 
                 data->doc = data->xmlparser->myDoc;
                 data->xmlparser->myDoc = NULL;
             }
         } else {
-            if (data->comp->successTest.type == XRLT_VALUE_XPATH) {
-                data->stage = XRLT_INCLUDE_TRANSFORM_SUCCESS_TEST_BEGIN;
-            } else {
-                data->stage = data->status >= 200 && data->status < 400 ?
-                    XRLT_INCLUDE_TRANSFORM_SUCCESS
-                    :
-                    XRLT_INCLUDE_TRANSFORM_FAILURE;
-            }
+            xrltIncludeSetResultStage(data);
         }
 
         //xmlDocFormatDump(stderr, data->doc, 1);
@@ -790,6 +825,184 @@ xrltProcessBody(xrltContextPtr ctx, xrltTransformValueSubrequestBody *val,
 }
 
 
+static void
+xrltIncludeParseTaskRun(void *data)
+{
+    // Called from a thread pool, only the task is touched here.
+    xrltIncludeParseTaskData  *task = (xrltIncludeParseTaskData *)data;
+    xmlParserCtxtPtr           xmlparser;
+    xrltJSON2XMLPtr            jsonparser;
+    xrltQueryStringParserPtr   qsparser;
+    const char                *buf = (const char *)xmlBufferContent(task->buf);
+    int                        len = xmlBufferLength(task->buf);
+
+    if (task->type == XRLT_SUBREQUEST_DATA_XML) {
+        xmlparser = xmlCreatePushParserCtxt(NULL, NULL, NULL, 0,
+                                            (const char *)task->href);
+
+        if (xmlparser == NULL) { return; }
+
+        if (xmlParseChunk(xmlparser, buf, len, 1) == 0 &&
+            xmlparser->wellFormed != 0)
+        {
+            task->doc = xmlparser->myDoc;
+            xmlparser->myDoc = NULL;
+            task->parsed = TRUE;
+        }
+
+        if (xmlparser->myDoc != NULL) { xmlFreeDoc(xmlparser->myDoc); }
+
+        xmlFreeParserCtxt(xmlparser);
+
+        return;
+    }
+
+    task->doc = xmlNewDoc(NULL);
+
+    if (task->doc == NULL) { return; }
+
+    if (task->type == XRLT_SUBREQUEST_DATA_JSON) {
+        jsonparser = xrltJSON2XMLInit((xmlNodePtr)task->doc, FALSE);
+
+        if (jsonparser == NULL) { return; }
+
+        task->parsed = xrltJSON2XMLFeed(jsonparser, (char *)buf, len);
+
+        xrltJSON2XMLFree(jsonparser);
+    } else {
+        qsparser = xrltQueryStringParserInit((xmlNodePtr)task->doc);
+
+        if (qsparser == NULL) { return; }
+
+        task->parsed = xrltQueryStringParserFeed(qsparser, (char *)buf, len,
+                                                 TRUE);
+
+        xrltQueryStringParserFree(qsparser);
+    }
+}
+
+
+static xrltBool
+xrltIncludeParseInputFunc(xrltContextPtr ctx, xrltTransformValue *val,
+                          void *payload)
+{
+    xrltIncludeTransformingData  *data;
+    xrltIncludeParseTaskData     *task;
+
+    data = (xrltIncludeTransformingData *)payload;
+
+    if (data == NULL || data->parse == NULL) { return FALSE; }
+
+    if (val->type != XRLT_TRANSFORM_VALUE_TASK) {
+        xrltTransformError(ctx, NULL, data->srcNode, "Unexpected input\n");
+        return FALSE;
+    }
+
+    task = data->parse;
+    data->parse = NULL;
+
+    data->doc = task->doc;
+    task->doc = NULL;
+
+    if (task->parsed) {
+        xrltIncludeSetResultStage(data);
+    } else {
+        data->stage = XRLT_INCLUDE_TRANSFORM_FAILURE;
+    }
+
+    xrltIncludeParseTaskFree(task);
+
+    SCHEDULE_CALLBACK(ctx, &ctx->tcb, xrltIncludeTransform, data->comp,
+                      data->insert, data);
+
+    return TRUE;
+}
+
+
+static inline xrltProcessInputResult
+xrltProcessBody(xrltContextPtr ctx, xrltTransformValueSubrequestBody *val,
+                xrltIncludeTransformingData *data)
+{
+    xrltIncludeParseTaskData          *task;
+    xrltTransformValueSubrequestBody   whole;
+    xrltProcessInputResult             ret;
+    size_t                             id;
+
+    if (ctx->parseThreshold == 0 ||
+        data->type == XRLT_SUBREQUEST_DATA_TEXT ||
+        data->comp == NULL ||
+        data->comp->includeType != XRLT_INCLUDE_TYPE_INCLUDE)
+    {
+        return xrltProcessBodyChunk(ctx, val, data);
+    }
+
+    // Collect the whole response, we don't know in advance if it is big
+    // enough to be parsed by a task.
+    if (data->buf == NULL) {
+        data->buf = xmlBufferCreate();
+
+        if (data->buf == NULL) {
+            ERROR_OUT_OF_MEMORY(ctx, NULL, data->srcNode);
+            return XRLT_PROCESS_INPUT_ERROR;
+        }
+    }
+
+    if (val->val.len > 0 &&
+        xmlBufferAdd(data->buf, (const xmlChar *)val->val.data,
+                     (int)val->val.len) != 0)
+    {
+        ERROR_OUT_OF_MEMORY(ctx, NULL, data->srcNode);
+        return XRLT_PROCESS_INPUT_ERROR;
+    }
+
+    if (!val->last) { return XRLT_PROCESS_INPUT_AGAIN; }
+
+    if ((size_t)xmlBufferLength(data->buf) < ctx->parseThreshold) {
+        whole.val.data = (char *)xmlBufferContent(data->buf);
+        whole.val.len = (size_t)xmlBufferLength(data->buf);
+        whole.last = TRUE;
+
+        ret = xrltProcessBodyChunk(ctx, &whole, data);
+
+        xmlBufferFree(data->buf);
+        data->buf = NULL;
+
+        return ret;
+    }
+
+    XRLT_MALLOC(ctx, NULL, data->srcNode, task, xrltIncludeParseTaskData *,
+                sizeof(xrltIncludeParseTaskData), XRLT_PROCESS_INPUT_ERROR);
+
+    data->parse = task;
+
+    task->type = data->type;
+    task->buf = data->buf;
+    data->buf = NULL;
+
+    if (data->href != NULL) {
+        task->href = xmlStrdup(data->href);
+
+        if (task->href == NULL) {
+            ERROR_OUT_OF_MEMORY(ctx, NULL, data->srcNode);
+            return XRLT_PROCESS_INPUT_ERROR;
+        }
+    }
+
+    id = xrltInputSubscribe(ctx, xrltIncludeParseInputFunc, data);
+
+    if (id == 0) { return XRLT_PROCESS_INPUT_ERROR; }
+
+    if (!xrltTaskListPush(&ctx->task, id, xrltIncludeParseTaskRun, task)) {
+        ERROR_OUT_OF_MEMORY(ctx, NULL, data->srcNode);
+        return XRLT_PROCESS_INPUT_ERROR;
+    }
+
+    ctx->cur |= XRLT_STATUS_TASK;
+
+    return XRLT_PROCESS_INPUT_AGAIN;
+}
+
+
 xrltProcessInputResult
 xrltProcessInput(xrltContextPtr ctx, xrltTransformValue *val,
                  xrltIncludeTransformingData *data)
@@ -856,6 +1069,7 @@ xrltProcessInput(xrltContextPtr ctx, xrltTransformValue *val,
 
         case XRLT_TRANSFORM_VALUE_ERROR:
         case XRLT_TRANSFORM_VALUE_EMPTY:
+        case XRLT_TRANSFORM_VALUE_TASK:
             // These are processed earlier. It is an error if we've got here.
             xrltTransformError(ctx, NULL, data->srcNode, "Strange type\n");
             break;
@@ -872,6 +1086,17 @@ xrltIncludeInputFunc(xrltContextPtr ctx, xrltTransformValue *val, void *data)
 
     if (data == NULL) { return FALSE; }
 
+    if (tdata->started != 0 &&
+        (val->type == XRLT_TRANSFORM_VALUE_ERROR ||
+         (val->type == XRLT_TRANSFORM_VALUE_BODY && val->bodyval.last)))
+    {
+        ctx->subrequestTime += xrltTimeNanoseconds() - tdata->started;
+
+        xrltTraceSpan(ctx, "include", tdata->href, tdata->traceId,
+                      tdata->started, NULL);
+        tdata->started = 0;
+    }
+
     if (val->type == XRLT_TRANSFORM_VALUE_ERROR) {
         tdata->stage = XRLT_INCLUDE_TRANSFORM_FAILURE;
 
@@ -1054,6 +1279,10 @@ xrltIncludeAddSubrequest(xrltContextPtr ctx, xrltIncludeTransformingData *data)
     }
 
     ctx->cur |= XRLT_STATUS_SUBREQUEST;
+    ctx->subrequests++;
+
+    data->traceId = id;
+    data->started = xrltTimeNanoseconds();
 
   error:
     xrltHeaderOutListClear(&header);
@@ -1505,7 +1734,7 @@ xrltRequestInputTransform(xrltContextPtr ctx, void *val, xmlNodePtr insert,
         if (insert == NULL) {
             if (tdata->comp != NULL && tdata->comp->name != NULL) {
                 // Initial call, need to create a variable.
-                vdoc = xmlNewDoc(NULL);
+                vdoc = xrltDocCreate(ctx);
 
                 if (vdoc == NULL) {
                     ERROR_CREATE_NODE(ctx, NULL, tdata->srcNode);
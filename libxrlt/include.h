@@ -94,6 +94,16 @@ typedef enum {
 } xrltProcessInputResult;
 
 
+typedef struct {
+    xrltSubrequestDataType      type;
+    xmlChar                    *href;
+    xmlBufferPtr                buf;        // Whole response body.
+
+    xrltBool                    parsed;
+    xmlDocPtr                   doc;
+} xrltIncludeParseTaskData;
+
+
 typedef struct {
     xmlNodePtr                  srcNode;    // Include node in source document.
 
@@ -112,6 +122,11 @@ typedef struct {
     xrltQueryStringParserPtr    qsparser;
     xmlDocPtr                   doc;        // Document to parse include result
                                             // to.
+    xmlBufferPtr                buf;        // Response body collected to be
+                                            // parsed by a task.
+    xrltIncludeParseTaskData   *parse;
+    size_t                      traceId;    // Subrequest id (for tracing).
+    size_t                      started;    // Subrequest issue time.
     xmlNodePtr                  insert;
     xrltCompiledIncludeData    *comp;
 
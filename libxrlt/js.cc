@@ -17,6 +17,7 @@ using v8::Object;
 using v8::Context;
 using v8::FunctionTemplate;
 using v8::Isolate;
+using v8::Locker;
 using v8::Local;
 using v8::Handle;
 using v8::HandleScope;
@@ -34,6 +35,9 @@ using v8::Number;
 
 
 typedef struct {
+    Isolate                       *isolate;
+    xrltJSContextPtr               next;      // Next context of the
+                                              // requestsheet.
     Persistent<ObjectTemplate>     globalTemplate;
     Persistent<Object>             global;
     Persistent<Object>             functions;
@@ -45,12 +49,41 @@ typedef struct {
 
 
 typedef struct {
+    Isolate             *isolate;
     xmlNodePtr           node;
     xmlNodePtr           src;
     Persistent<Object>   deferred;
 } xrltDeferredInsertTransformingData;
 
 
+typedef struct _xrltJSFunctionDef xrltJSFunctionDef;
+struct _xrltJSFunctionDef {
+    xmlNodePtr             node;
+    xmlChar               *name;
+    xrltVariableDataPtr   *param;
+    size_t                 paramLen;
+    xmlChar               *code;
+    xrltJSFunctionDef     *next;
+};
+
+
+typedef struct _xrltJSIsolateItem xrltJSIsolateItem;
+struct _xrltJSIsolateItem {
+    Isolate             *isolate;
+    xrltJSIsolateItem   *next;
+};
+
+
+// Every thread gets its own isolate on its first JavaScript call, so that
+// the threads don't wait for each other. The isolates are still locked on
+// entry: a requestsheet might be freed on another thread, and a context
+// keeps using the isolate it has started with if it moves to another
+// thread. Nobody else waits for the lock otherwise.
+static XRLT_THREAD_LOCAL Isolate  *xrltJSThreadIsolate = NULL;
+// All the isolates created, to dispose of them in xrltJSFree().
+static xrltJSIsolateItem          *xrltJSIsolates = NULL;
+
+
 static xrltBool xrltDeferredInsert   (Isolate *isolate,
                                       xrltContextPtr ctx, void *val,
                                       xmlNodePtr insert, xmlNodePtr src,
@@ -222,10 +255,52 @@ xrltJSInit(void)
 void
 xrltJSFree(void)
 {
+    xrltJSIsolateItem  *item;
+
+    while (xrltJSIsolates != NULL) {
+        item = xrltJSIsolates;
+        xrltJSIsolates = item->next;
+
+        item->isolate->Dispose();
+
+        xmlFree(item);
+    }
+
+    xrltJSThreadIsolate = NULL;
+
     V8::Dispose();
 }
 
 
+static Isolate *
+xrltJSIsolateGet(void)
+{
+    xrltJSIsolateItem  *item;
+
+    if (xrltJSThreadIsolate != NULL) { return xrltJSThreadIsolate; }
+
+    item = (xrltJSIsolateItem *)xmlMalloc(sizeof(xrltJSIsolateItem));
+
+    if (item == NULL) { return NULL; }
+
+    item->isolate = Isolate::New();
+
+    if (item->isolate == NULL) {
+        xmlFree(item);
+        return NULL;
+    }
+
+    do {
+        item->next = xrltJSIsolates;
+    } while (!__sync_bool_compare_and_swap(&xrltJSIsolates, item->next,
+                                           item));
+
+    xrltJSThreadIsolate = item->isolate;
+
+    return item->isolate;
+}
+
+
 // Extracts a C string from a V8 Utf8Value.
 const char* ToCString(const String::Utf8Value& value) {
     return *value ? *value : "<string conversion failed>";
@@ -323,7 +398,12 @@ xrltJSContextCreate(void)
 {
     xrltJSContextPtr       ret;
     xrltJSContextPrivate  *priv;
-    Isolate               *isolate = Isolate::GetCurrent();
+    Isolate               *isolate = xrltJSIsolateGet();
+
+    if (isolate == NULL) { return NULL; }
+
+    Locker                 locker(isolate);
+    Isolate::Scope         isolate_scope(isolate);
     HandleScope            scope(isolate);
 
     Local<External>        data;
@@ -388,6 +468,7 @@ xrltJSContextCreate(void)
 
     global->Set(String::NewFromUtf8(isolate, "global"), global);
 
+    priv->isolate = isolate;
     priv->context.Reset(isolate, context);
     priv->globalTemplate.Reset(isolate, globalTpl);
     priv->global.Reset(isolate, global);
@@ -406,16 +487,16 @@ xrltJSContextFree(xrltJSContextPtr jsctx)
     if (jsctx == NULL) { return; }
 
     xrltJSContextPrivate  *priv = (xrltJSContextPrivate *)jsctx->_private;
+    Locker                 locker(priv->isolate);
+    Isolate::Scope         isolate_scope(priv->isolate);
 
-    if (priv != NULL) {
-        priv->functions.Reset();
-        priv->context.Reset();
-        priv->global.Reset();
-        priv->globalTemplate.Reset();
-        priv->deferredTemplate.Reset();
-        priv->xml2jsCacheTemplate.Reset();
-        priv->xml2jsTemplate.Reset();
-    }
+    priv->functions.Reset();
+    priv->context.Reset();
+    priv->global.Reset();
+    priv->globalTemplate.Reset();
+    priv->deferredTemplate.Reset();
+    priv->xml2jsCacheTemplate.Reset();
+    priv->xml2jsTemplate.Reset();
 
     xmlFree(jsctx);
 
@@ -423,30 +504,47 @@ xrltJSContextFree(xrltJSContextPtr jsctx)
 }
 
 
-xrltBool
-xrltJSFunction(xrltRequestsheetPtr sheet, xmlNodePtr node, xmlChar *name,
-               xrltVariableDataPtr *param, size_t paramLen,
-               const xmlChar *code)
+void
+xrltJSSheetFree(xrltJSSheetPtr js)
 {
-    if (sheet == NULL || name == NULL || code == NULL) { return FALSE; }
+    if (js == NULL) { return; }
 
-    xrltJSContextPtr   jsctx = (xrltJSContextPtr)sheet->js;
+    xrltJSContextPtr    jsctx, next;
+    xrltJSFunctionDef  *def, *tmp;
 
-    if (jsctx == NULL) {
-        jsctx = xrltJSContextCreate();
+    for (jsctx = js->contexts; jsctx != NULL; jsctx = next) {
+        next = ((xrltJSContextPrivate *)jsctx->_private)->next;
 
-        if (jsctx == NULL) {
-            xrltTransformError(NULL, sheet, node,
-                               "JavaScript context creation failed\n");
-            return FALSE;
-        }
+        xrltJSContextFree(jsctx);
+    }
+
+    def = (xrltJSFunctionDef *)js->funcs;
 
-        sheet->js = jsctx;
+    while (def != NULL) {
+        tmp = def->next;
+
+        xmlFree(def->name);
+        xmlFree(def->code);
+        xmlFree(def);
+
+        def = tmp;
     }
 
+    xmlFree(js);
+}
+
+
+static xrltBool
+xrltJSContextAddFunction(xrltContextPtr ctx, xrltRequestsheetPtr sheet,
+                         xrltJSContextPtr jsctx, xrltJSFunctionDef *def)
+{
     xrltJSContextPrivate  *priv = (xrltJSContextPrivate *)jsctx->_private;
+    xrltVariableDataPtr   *param = def->param;
+    size_t                 paramLen = def->paramLen;
 
-    Isolate               *isolate = Isolate::GetCurrent();
+    Isolate               *isolate = priv->isolate;
+    Locker                 locker(isolate);
+    Isolate::Scope         isolate_scope(isolate);
     HandleScope            scope(isolate);
     Local<Context>         context = \
         Local<Context>::New(isolate, priv->context);
@@ -481,7 +579,7 @@ xrltJSFunction(xrltRequestsheetPtr sheet, xmlNodePtr node, xmlChar *name,
         count = 0;
     }
 
-    argv[argc++] = String::NewFromUtf8(isolate, (char *)code);
+    argv[argc++] = String::NewFromUtf8(isolate, (char *)def->code);
 
     constr = Local<Function>::Cast(
         global->Get(String::NewFromUtf8(isolate, "Function"))
@@ -492,7 +590,7 @@ xrltJSFunction(xrltRequestsheetPtr sheet, xmlNodePtr node, xmlChar *name,
     func = constr->NewInstance(argc, argv);
 
     if (trycatch.HasCaught()) {
-        ReportException(isolate, NULL, sheet, node, &trycatch);
+        ReportException(isolate, ctx, sheet, def->node, &trycatch);
 
         return FALSE;
     }
@@ -501,12 +599,134 @@ xrltJSFunction(xrltRequestsheetPtr sheet, xmlNodePtr node, xmlChar *name,
     funcwrap->Set(String::NewFromUtf8(isolate, "1"),
                   Number::New(isolate, count));
 
-    funcs->Set(String::NewFromUtf8(isolate, (char *)name), funcwrap);
+    funcs->Set(String::NewFromUtf8(isolate, (char *)def->name), funcwrap);
 
     return TRUE;
 }
 
 
+static xrltJSContextPtr
+xrltJSContextFind(xrltJSSheetPtr js, Isolate *isolate)
+{
+    xrltJSContextPtr   jsctx;
+
+    for (jsctx = js->contexts;
+         jsctx != NULL;
+         jsctx = ((xrltJSContextPrivate *)jsctx->_private)->next)
+    {
+        if (((xrltJSContextPrivate *)jsctx->_private)->isolate == isolate) {
+            return jsctx;
+        }
+    }
+
+    return NULL;
+}
+
+
+static xrltJSContextPtr
+xrltJSContextGet(xrltContextPtr ctx, xrltRequestsheetPtr sheet,
+                 xmlNodePtr node)
+{
+    // Context of the requestsheet in the isolate of this thread, created
+    // on the first use.
+    xrltJSSheetPtr         js = (xrltJSSheetPtr)sheet->js;
+    xrltJSContextPtr       jsctx;
+    xrltJSContextPrivate  *priv;
+    xrltJSFunctionDef     *def;
+    Isolate               *isolate = xrltJSIsolateGet();
+
+    if (isolate != NULL) {
+        jsctx = xrltJSContextFind(js, isolate);
+
+        if (jsctx != NULL) { return jsctx; }
+
+        jsctx = xrltJSContextCreate();
+    } else {
+        jsctx = NULL;
+    }
+
+    if (jsctx == NULL) {
+        xrltTransformError(ctx, sheet, node,
+                           "JavaScript context creation failed\n");
+        return NULL;
+    }
+
+    for (def = (xrltJSFunctionDef *)js->funcs; def != NULL; def = def->next) {
+        if (!xrltJSContextAddFunction(ctx, sheet, jsctx, def)) {
+            xrltJSContextFree(jsctx);
+            return NULL;
+        }
+    }
+
+    // Only this thread adds contexts of its isolate, but the other threads
+    // might be adding theirs meanwhile.
+    priv = (xrltJSContextPrivate *)jsctx->_private;
+
+    do {
+        priv->next = js->contexts;
+    } while (!__sync_bool_compare_and_swap(&js->contexts, priv->next, jsctx));
+
+    return jsctx;
+}
+
+
+xrltBool
+xrltJSFunction(xrltRequestsheetPtr sheet, xmlNodePtr node, xmlChar *name,
+               xrltVariableDataPtr *param, size_t paramLen,
+               const xmlChar *code)
+{
+    if (sheet == NULL || name == NULL || code == NULL) { return FALSE; }
+
+    xrltJSSheetPtr       js = (xrltJSSheetPtr)sheet->js;
+    xrltJSFunctionDef   *def;
+    xrltJSFunctionDef  **last;
+    xrltJSContextPtr     jsctx;
+
+    if (js == NULL) {
+        XRLT_MALLOC(NULL, sheet, node, js, xrltJSSheetPtr,
+                    sizeof(xrltJSSheet), FALSE);
+
+        sheet->js = js;
+    }
+
+    // Definitions are kept to set up the contexts of the other isolates,
+    // in order, so that the last one of a name wins everywhere.
+    XRLT_MALLOC(NULL, sheet, node, def, xrltJSFunctionDef *,
+                sizeof(xrltJSFunctionDef), FALSE);
+
+    for (last = (xrltJSFunctionDef **)&js->funcs;
+         *last != NULL;
+         last = &(*last)->next);
+
+    *last = def;
+
+    def->node = node;
+    def->param = param;
+    def->paramLen = paramLen;
+    def->name = xmlStrdup(name);
+    def->code = xmlStrdup(code);
+
+    if (def->name == NULL || def->code == NULL) {
+        ERROR_OUT_OF_MEMORY(NULL, sheet, node);
+        return FALSE;
+    }
+
+    // The function is compiled right away to report the errors. A new
+    // context compiles it along with the rest.
+    jsctx = xrltJSThreadIsolate == NULL
+        ?
+        NULL
+        :
+        xrltJSContextFind(js, xrltJSThreadIsolate);
+
+    if (jsctx == NULL) {
+        return xrltJSContextGet(NULL, sheet, node) != NULL;
+    }
+
+    return xrltJSContextAddFunction(NULL, sheet, jsctx, def);
+}
+
+
 static void
 xrltDeferredInsertTransformingFree(void *data)
 {
@@ -515,6 +735,9 @@ xrltDeferredInsertTransformingFree(void *data)
                                     (xrltDeferredInsertTransformingData *)data;
 
         if (!tdata->deferred.IsEmpty()) {
+            Locker           locker(tdata->isolate);
+            Isolate::Scope   isolate_scope(tdata->isolate);
+
             tdata->deferred.Reset();
         }
 
@@ -549,9 +772,10 @@ xrltDeferredInsert(Isolate *isolate, xrltContextPtr ctx, void *val,
         n->data = data;
         n->free = xrltDeferredInsertTransformingFree;
 
+        data->isolate = isolate;
         data->node = node;
         data->src = src;
-        data->deferred.Reset(Isolate::GetCurrent(), *d);
+        data->deferred.Reset(isolate, *d);
 
         protoTempl = ObjectTemplate::New();
         protoTempl->SetInternalFieldCount(2);
@@ -635,7 +859,7 @@ xrltJS2XML(Isolate *isolate, xrltContextPtr ctx, xrltJSON2XMLPtr js2xml,
 
         xrltJSON2XMLArrayEnd(js2xml);
     } else if (val->IsObject()) {
-        xrltJSContextPtr          jsctx = (xrltJSContextPtr)ctx->sheet->js;
+        xrltJSContextPtr          jsctx = (xrltJSContextPtr)ctx->js;
         xrltJSContextPrivate     *priv = \
                                        (xrltJSContextPrivate *)jsctx->_private;
 
@@ -692,11 +916,13 @@ xrltDeferredVariableResolve(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
     xrltDeferredTransformingPtr   dcomp = (xrltDeferredTransformingPtr)comp;
     xmlXPathObjectPtr             val;
 
-    xrltJSContextPtr              jsctx = (xrltJSContextPtr)ctx->sheet->js;
+    xrltJSContextPtr              jsctx = (xrltJSContextPtr)ctx->js;
     xrltJSContextPrivate         *priv = \
                                       (xrltJSContextPrivate *)jsctx->_private;
 
-    Isolate                      *isolate = Isolate::GetCurrent();
+    Isolate                      *isolate = priv->isolate;
+    Locker                        locker(isolate);
+    Isolate::Scope                isolate_scope(isolate);
     HandleScope                   scope(isolate);
 
     Local<Context>                context = \
@@ -753,11 +979,21 @@ xrltJSApply(xrltContextPtr ctx, xmlNodePtr node, xmlChar *name,
 {
     if (ctx == NULL || name == NULL || insert == NULL) { return FALSE; }
 
-    xrltJSContextPtr              jsctx = (xrltJSContextPtr)ctx->sheet->js;
+    // A context sticks to the JavaScript context of its first call, the
+    // deferred values it hands out live there.
+    if (ctx->js == NULL) {
+        ctx->js = xrltJSContextGet(ctx, ctx->sheet, node);
+
+        if (ctx->js == NULL) { return FALSE; }
+    }
+
+    xrltJSContextPtr              jsctx = (xrltJSContextPtr)ctx->js;
     xrltJSContextPrivate         *priv = \
                                       (xrltJSContextPrivate *)jsctx->_private;
 
-    Isolate                      *isolate = Isolate::GetCurrent();
+    Isolate                      *isolate = priv->isolate;
+    Locker                        locker(isolate);
+    Isolate::Scope                isolate_scope(isolate);
     HandleScope                   scope(isolate);
     Local<Context>                context = \
                                     Local<Context>::New(isolate, priv->context);
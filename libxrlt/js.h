@@ -24,6 +24,18 @@ struct _xrltJSContext {
 };
 
 
+// JavaScript of a requestsheet. Every thread runs JavaScript in its own
+// isolate, the requestsheet gets a context per isolate it is used in.
+typedef struct _xrltJSSheet xrltJSSheet;
+typedef xrltJSSheet* xrltJSSheetPtr;
+struct _xrltJSSheet {
+    void               *funcs;      // Function definitions to set up new
+                                    // contexts with.
+    xrltJSContextPtr    contexts;   // Contexts of the isolates, added
+                                    // without locking.
+};
+
+
 typedef struct _xrltJSArgument xrltJSArgument;
 typedef xrltJSArgument* xrltJSArgumentPtr;
 struct _xrltJSArgument {
@@ -69,6 +81,8 @@ xrltJSContextPtr
         xrltJSContextCreate        (void);
 void
         xrltJSContextFree          (xrltJSContextPtr jsctx);
+void
+        xrltJSSheetFree            (xrltJSSheetPtr js);
 xrltBool
         xrltJSFunction             (xrltRequestsheetPtr sheet, xmlNodePtr node,
                                     xmlChar *name, xrltVariableDataPtr *param,
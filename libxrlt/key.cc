@@ -0,0 +1,352 @@
+/*
+ * Copyright Marat Abdullin (https://github.com/hoho)
+ */
+
+#include "transform.h"
+#include "key.h"
+
+
+static void
+xrltKeyRemove(void *payload, const xmlChar *name)
+{
+    xrltKeyFree(payload);
+}
+
+
+void *
+xrltKeyCompile(xrltRequestsheetPtr sheet, xmlNodePtr node, void *prevcomp)
+{
+    xrltKeyData      *ret = NULL;
+    xmlChar          *match = NULL;
+    xmlChar          *use = NULL;
+    xmlNsPtr         *nsList = NULL;
+    const xmlChar   **ns = NULL;
+    int               i;
+
+    XRLT_MALLOC(NULL, sheet, node, ret, xrltKeyData*, sizeof(xrltKeyData),
+                NULL);
+
+    if (sheet->keys == NULL) {
+        sheet->keys = xmlHashCreate(20);
+
+        if (sheet->keys == NULL) {
+            xrltTransformError(NULL, sheet, node,
+                               "Keys hash creation failed\n");
+            goto error;
+        }
+    }
+
+    ret->node = node;
+    ret->name = xmlGetProp(node, XRLT_ELEMENT_ATTR_NAME);
+
+    if (xmlValidateNCName(ret->name, 0)) {
+        xrltTransformError(NULL, sheet, node, "Invalid key name\n");
+        goto error;
+    }
+
+    match = xmlGetProp(node, XRLT_ELEMENT_ATTR_MATCH);
+
+    if (match == NULL) {
+        xrltTransformError(NULL, sheet, node, "No 'match' attribute\n");
+        goto error;
+    }
+
+    use = xmlGetProp(node, XRLT_ELEMENT_ATTR_USE);
+
+    if (use == NULL) {
+        xrltTransformError(NULL, sheet, node, "No 'use' attribute\n");
+        goto error;
+    }
+
+    // The pattern gets the namespaces in scope of the key element.
+    nsList = xmlGetNsList(node->doc, node);
+
+    if (nsList != NULL) {
+        i = 0;
+
+        while (nsList[i] != NULL) { i++; }
+
+        ns = (const xmlChar **)xmlMalloc(sizeof(xmlChar *) * (i + i + 2));
+
+        if (ns == NULL) {
+            ERROR_OUT_OF_MEMORY(NULL, sheet, node);
+            goto error;
+        }
+
+        ns[i + i] = NULL;
+        ns[i + i + 1] = NULL;
+
+        for (i = 0; nsList[i] != NULL; i++) {
+            ns[i + i] = nsList[i]->href;
+            ns[i + i + 1] = nsList[i]->prefix;
+        }
+    }
+
+    ret->match = xmlPatterncompile(match, NULL, 0, ns);
+
+    if (ret->match == NULL) {
+        xrltTransformError(NULL, sheet, node,
+                           "Failed to compile 'match' pattern\n");
+        goto error;
+    }
+
+    if (!xrltXPathCompile(sheet, use, &ret->use)) {
+        xrltTransformError(NULL, sheet, node,
+                           "Failed to compile 'use' expression\n");
+        goto error;
+    }
+
+    // Indexes are built from inside of key() calls, there is no way to
+    // wait for a variable there. XSLT doesn't allow variables in keys
+    // either.
+    if (ret->use.compiled != NULL && ret->use.compiled->vars != NULL) {
+        xrltTransformError(NULL, sheet, node,
+                           "Variable reference in 'use' expression\n");
+        goto error;
+    }
+
+    ret->use.src = node;
+    ret->use.scope = node->parent;
+
+    // We keep the last key declaration as a key.
+    xmlHashRemoveEntry(sheet->keys, ret->name, xrltKeyRemove);
+
+    if (xmlHashAddEntry(sheet->keys, ret->name, ret)) {
+        xrltTransformError(NULL, sheet, node, "Failed to add key\n");
+        goto error;
+    }
+
+    xmlFree(match);
+    xmlFree(use);
+    if (nsList != NULL) { xmlFree(nsList); }
+    if (ns != NULL) { xmlFree(ns); }
+
+    return ret;
+
+  error:
+    if (match != NULL) { xmlFree(match); }
+    if (use != NULL) { xmlFree(use); }
+    if (nsList != NULL) { xmlFree(nsList); }
+    if (ns != NULL) { xmlFree(ns); }
+    xrltKeyFree(ret);
+
+    return NULL;
+}
+
+
+void
+xrltKeyFree(void *comp)
+{
+    if (comp != NULL) {
+        xrltKeyData       *k = (xrltKeyData *)comp;
+        xrltNodeDataPtr    n;
+
+        if (k->name != NULL) { xmlFree(k->name); }
+
+        if (k->match != NULL) { xmlFreePattern(k->match); }
+
+        if (k->use.compiled != NULL) { xrltXPathRelease(k->use.compiled); }
+
+        if (k->node && k->node->_private) {
+            n = (xrltNodeDataPtr)k->node->_private;
+            n->data = NULL;
+        }
+
+        xmlFree(comp);
+    }
+}
+
+
+static void
+xrltKeyValueFree(void *payload, const xmlChar *name)
+{
+    xmlXPathFreeNodeSet((xmlNodeSetPtr)payload);
+}
+
+
+static void
+xrltKeyValuesFree(void *payload, const xmlChar *name)
+{
+    xmlHashFree((xmlHashTablePtr)payload, xrltKeyValueFree);
+}
+
+
+void
+xrltKeyIndexFree(void *keys)
+{
+    xmlHashFree((xmlHashTablePtr)keys, xrltKeyValuesFree);
+}
+
+
+static xrltBool
+xrltKeyIndexAdd(xmlHashTablePtr values, xmlChar *value, xmlNodePtr node)
+{
+    xmlNodeSetPtr   set;
+    xrltBool        ret = TRUE;
+
+    if (value == NULL) { return FALSE; }
+
+    set = (xmlNodeSetPtr)xmlHashLookup(values, value);
+
+    if (set == NULL) {
+        set = xmlXPathNodeSetCreate(node);
+
+        if (set == NULL || xmlHashAddEntry(values, value, set)) {
+            if (set != NULL) { xmlXPathFreeNodeSet(set); }
+            ret = FALSE;
+        }
+    } else if (set->nodeTab[set->nodeNr - 1] != node) {
+        // Nodes come in document order, each one once, but it might
+        // have the same value more than once.
+        ret = xmlXPathNodeSetAddUnique(set, node) == 0;
+    }
+
+    xmlFree(value);
+
+    return ret;
+}
+
+
+static xmlHashTablePtr
+xrltKeyIndexBuild(xrltContextPtr ctx, xrltKeyData *key, xmlDocPtr doc)
+{
+    xmlXPathContextPtr   xpath = ctx->xpath;
+    xmlDocPtr            oldDoc = xpath->doc;
+    xmlNodePtr           oldNode = xpath->node;
+    int                  oldContextSize = xpath->contextSize;
+    int                  oldProximityPosition = xpath->proximityPosition;
+    xmlHashTablePtr      values;
+    xmlXPathObjectPtr    val;
+    xmlNodePtr           node;
+    xrltBool             ok = TRUE;
+    int                  i;
+
+    values = xmlHashCreate(64);
+
+    if (values == NULL) {
+        ERROR_OUT_OF_MEMORY(ctx, NULL, key->node);
+        return NULL;
+    }
+
+    // One pass over the document in document order, the use expression is
+    // evaluated for every matching element.
+    node = doc->children;
+
+    while (node != NULL && ok) {
+        if (node->type == XML_ELEMENT_NODE &&
+            xmlPatternMatch(key->match, node) == 1)
+        {
+            xpath->doc = doc;
+            xpath->node = node;
+            xpath->contextSize = 1;
+            xpath->proximityPosition = 1;
+
+            val = xmlXPathCompiledEval(key->use.expr, xpath);
+
+            if (val == NULL) {
+                xrltTransformError(ctx, NULL, key->node,
+                                   "Failed to evaluate 'use' expression\n");
+                ok = FALSE;
+                break;
+            }
+
+            if (val->type == XPATH_NODESET) {
+                for (i = 0; val->nodesetval != NULL &&
+                            i < val->nodesetval->nodeNr && ok; i++)
+                {
+                    ok = xrltKeyIndexAdd(
+                        values,
+                        xmlXPathCastNodeToString(val->nodesetval->nodeTab[i]),
+                        node
+                    );
+                }
+            } else {
+                ok = xrltKeyIndexAdd(values, xmlXPathCastToString(val), node);
+            }
+
+            xmlXPathFreeObject(val);
+
+            if (!ok) {
+                ERROR_OUT_OF_MEMORY(ctx, NULL, key->node);
+                break;
+            }
+        }
+
+        if (node->type == XML_ELEMENT_NODE && node->children != NULL) {
+            node = node->children;
+            continue;
+        }
+
+        while (node != NULL && node->next == NULL) {
+            node = node->parent;
+
+            if (node == (xmlNodePtr)doc) { node = NULL; }
+        }
+
+        if (node != NULL) { node = node->next; }
+    }
+
+    xpath->doc = oldDoc;
+    xpath->node = oldNode;
+    xpath->contextSize = oldContextSize;
+    xpath->proximityPosition = oldProximityPosition;
+
+    if (!ok) {
+        xmlHashFree(values, xrltKeyValueFree);
+        return NULL;
+    }
+
+    return values;
+}
+
+
+xrltBool
+xrltKeyLookup(xrltContextPtr ctx, const xmlChar *name, xmlDocPtr doc,
+              const xmlChar *value, xmlNodeSetPtr *ret)
+{
+    // Indexes live on the document node and go away with the document, they
+    // are built on the first lookup, once the document is complete.
+    xrltKeyData       *key;
+    xrltNodeDataPtr    n;
+    xmlHashTablePtr    values;
+
+    key = ctx->sheet->keys == NULL
+        ?
+        NULL
+        :
+        (xrltKeyData *)xmlHashLookup(ctx->sheet->keys, name);
+
+    if (key == NULL) {
+        xrltTransformError(ctx, NULL, ctx->src, "Unknown key '%s'\n", name);
+        return FALSE;
+    }
+
+    ASSERT_NODE_DATA(doc, n);
+
+    if (n->keys == NULL) {
+        n->keys = xmlHashCreate(4);
+
+        if (n->keys == NULL) {
+            ERROR_OUT_OF_MEMORY(ctx, NULL, key->node);
+            return FALSE;
+        }
+    }
+
+    values = (xmlHashTablePtr)xmlHashLookup((xmlHashTablePtr)n->keys, name);
+
+    if (values == NULL) {
+        values = xrltKeyIndexBuild(ctx, key, doc);
+
+        if (values == NULL) { return FALSE; }
+
+        if (xmlHashAddEntry((xmlHashTablePtr)n->keys, name, values)) {
+            xmlHashFree(values, xrltKeyValueFree);
+            ERROR_OUT_OF_MEMORY(ctx, NULL, key->node);
+            return FALSE;
+        }
+    }
+
+    *ret = (xmlNodeSetPtr)xmlHashLookup(values, value);
+
+    return TRUE;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright Marat Abdullin (https://github.com/hoho)
+ */
+
+#ifndef __XRLT_KEY_H__
+#define __XRLT_KEY_H__
+
+
+#include <libxml/tree.h>
+#include <libxml/xpath.h>
+#include <libxml/pattern.h>
+#include <xrlt.h>
+#include "xrltstruct.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+typedef struct {
+    xmlNodePtr      node;
+    xmlChar        *name;
+    xmlPatternPtr   match;
+    xrltXPathExpr   use;
+} xrltKeyData;
+
+
+void *
+        xrltKeyCompile     (xrltRequestsheetPtr sheet, xmlNodePtr node,
+                            void *prevcomp);
+void
+        xrltKeyFree        (void *comp);
+xrltBool
+        xrltKeyLookup      (xrltContextPtr ctx, const xmlChar *name,
+                            xmlDocPtr doc, const xmlChar *value,
+                            xmlNodeSetPtr *ret);
+void
+        xrltKeyIndexFree   (void *keys);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __XRLT_KEY_H__ */
@@ -56,6 +56,9 @@
                 "valueof.cc",
                 "copyof.cc",
                 "foreach.cc",
+                "key.cc",
+                "profile.cc",
+                "trace.cc",
                 "ccan_json.cc",
 
                 "deps/yajl/src/yajl.c",
@@ -112,6 +115,16 @@
                 "tests/transform/test.c",
             ],
         },
+        {
+            "target_name": "xrlt_bench",
+            "type": "executable",
+            "dependencies": [
+                "libxrlt",
+            ],
+            "sources": [
+                "tests/bench/bench.c",
+            ],
+        },
         {
             "target_name": "querystring_test",
             "type": "executable",
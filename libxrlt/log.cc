@@ -105,7 +105,7 @@ xrltLogTransform(xrltContextPtr ctx, void *comp, xmlNodePtr insert, void *data)
         xrltString   msg;
         xrltBool     pushed;
 
-        msg.data = (char *)xmlXPathCastNodeToString(log);
+        msg.data = (char *)xrltNodeToString(log);
 
         REMOVE_RESPONSE_NODE(ctx, log);
 
@@ -0,0 +1,128 @@
+/*
+ * Copyright Marat Abdullin (https://github.com/hoho)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "transform.h"
+
+
+typedef struct _xrltProfileFrame xrltProfileFrame;
+struct _xrltProfileFrame {
+    xmlNodePtr          node;
+    xrltProfileFrame   *parent;
+};
+
+
+xrltBool
+xrltProfileEnable(xrltContextPtr ctx)
+{
+    if (ctx == NULL) { return FALSE; }
+
+    if (ctx->profile != NULL) { return TRUE; }
+
+    XRLT_MALLOC(ctx, NULL, NULL, ctx->profile, xrltProfileEntry *,
+                sizeof(xrltProfileEntry) * (ctx->sheet->nodeCount + 1), FALSE);
+
+    return TRUE;
+}
+
+
+static void
+xrltProfileDumpFrames(xrltProfileFrame *frame, xmlBufferPtr buf)
+{
+    xmlNodePtr        node = frame->node;
+    xrltNodeDataPtr   n = (xrltNodeDataPtr)node->_private;
+    char              line[32];
+
+    if (frame->parent != NULL) {
+        xrltProfileDumpFrames(frame->parent, buf);
+        xmlBufferCCat(buf, ";");
+    }
+
+    if (node->type == XML_ELEMENT_NODE) {
+        if (node->ns != NULL && node->ns->prefix != NULL) {
+            xmlBufferCat(buf, node->ns->prefix);
+            xmlBufferCCat(buf, ":");
+        }
+
+        xmlBufferCat(buf, node->name);
+    } else {
+        xmlBufferCCat(buf, "text");
+    }
+
+    xmlBufferCCat(buf, " (");
+
+    if (n != NULL && n->url != NULL) {
+        xmlBufferCat(buf, n->url);
+    } else if (node->doc != NULL && node->doc->URL != NULL) {
+        xmlBufferCat(buf, node->doc->URL);
+    } else {
+        xmlBufferCCat(buf, "requestsheet");
+    }
+
+    snprintf(line, sizeof(line), ":%ld)", xmlGetLineNo(node));
+    xmlBufferCCat(buf, line);
+}
+
+
+static void
+xrltProfileDumpEntry(xrltProfileFrame *frame, xrltProfileEntry *entry,
+                     xmlBufferPtr buf)
+{
+    char   time[32];
+
+    if (entry->calls == 0) { return; }
+
+    xrltProfileDumpFrames(frame, buf);
+
+    snprintf(time, sizeof(time), " %zu\n", entry->time);
+    xmlBufferCCat(buf, time);
+}
+
+
+static void
+xrltProfileDumpNodes(xrltContextPtr ctx, xrltProfileFrame *parent,
+                     xmlNodePtr first, xmlBufferPtr buf)
+{
+    xrltProfileFrame   frame;
+    xrltNodeDataPtr    n;
+
+    frame.parent = parent;
+
+    while (first != NULL) {
+        n = (xrltNodeDataPtr)first->_private;
+
+        if (n != NULL && n->id > 0 && n->id <= ctx->sheet->nodeCount) {
+            frame.node = first;
+
+            xrltProfileDumpEntry(&frame, &ctx->profile[n->id], buf);
+
+            xrltProfileDumpNodes(ctx, &frame, first->children, buf);
+        }
+
+        first = first->next;
+    }
+}
+
+
+xrltBool
+xrltProfileDump(xrltContextPtr ctx, xmlBufferPtr buf)
+{
+    if (ctx == NULL || buf == NULL || ctx->profile == NULL) { return FALSE; }
+
+    xrltProfileFrame   root;
+
+    root.node = xmlDocGetRootElement(ctx->sheet->doc);
+    root.parent = NULL;
+
+    if (root.node == NULL) { return FALSE; }
+
+    // Everything run outside of requestsheet elements goes to the root.
+    xrltProfileDumpEntry(&root, &ctx->profile[0], buf);
+
+    xrltProfileDumpNodes(ctx, &root, root.node->children, buf);
+
+    return TRUE;
+}
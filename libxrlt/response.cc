@@ -4,6 +4,7 @@
 
 #include "transform.h"
 #include "response.h"
+#include "variable.h"
 
 
 void *
@@ -46,9 +47,13 @@ xrltResponseTransform(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
     } else {
         // On the second call, check if something is ready to be sent and send
         // it if it is.
-        xrltNodeDataPtr   n;
-        xrltString        chunk;
-        xrltBool          pushed;
+        xrltNodeDataPtr            n;
+        xmlNodePtr                 node;
+        xrltString                 chunk;
+        xrltVariableReleaseData   *rdata;
+        xrltBool                   pushed;
+        size_t                     started;
+        char                       args[64];
 
         response = ctx->response;
 
@@ -64,9 +69,11 @@ xrltResponseTransform(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
                 break;
             }
 
+            started = TRACE_START(ctx);
+
             // Send response chunk out.
             // TODO: Gather as many response chunks as possible into one buffer.
-            chunk.data = (char *)xmlXPathCastNodeToString(ctx->responseCur);
+            chunk.data = (char *)xrltNodeToString(ctx->responseCur);
 
             if (chunk.data != NULL) {
                 chunk.len = strlen(chunk.data);
@@ -87,10 +94,35 @@ xrltResponseTransform(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
 
                 if (chunk.len > 0) {
                     ctx->cur |= XRLT_STATUS_CHUNK;
+                    ctx->bytesOut += chunk.len;
+
+                    if (started != 0) {
+                        snprintf(args, sizeof(args), "{\"bytes\":%zu}",
+                                 chunk.len);
+                        xrltTraceSpan(ctx, "chunk", NULL, 0, started, args);
+                    }
+                }
+            }
+
+            node = ctx->responseCur;
+            ctx->responseCur = node->next;
+
+            if (n->free == xrltVariableReleaseFree) {
+                // Everything that uses the variables is sent.
+                rdata = (xrltVariableReleaseData *)n->data;
+
+                if (!xrltVariableRelease(ctx, rdata->first, NULL,
+                                         (void *)(rdata->scope + 1)))
+                {
+                    return FALSE;
                 }
             }
 
-            ctx->responseCur = ctx->responseCur->next;
+            // Nothing is pending inside the node (its counter is zero), so
+            // nothing refers to it anymore. Free it right away for the
+            // response document to hold the not yet sent part only.
+            xmlUnlinkNode(node);
+            xmlFreeNode(node);
         }
 
         if (ctx->responseCur != NULL) {
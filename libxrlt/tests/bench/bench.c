@@ -0,0 +1,539 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include <libxml/parser.h>
+#include <xrlt.h>
+#include <xrlterror.h>
+
+
+/*
+ * Replays transform test fixtures (testN.xrl + testN.in pairs) through
+ * xrltContextCreate()/xrltTransform() many times and reports the average
+ * cost of one request.
+ *
+ *   xrlt_bench [-n iterations] [-m] [-p] [-t] test1.xrl test1.in [...]
+ *
+ * -m prints one JSON object per fixture, suitable for tracking regressions.
+ * -p prints the profile of the last request of every fixture in collapsed
+ * stack format.
+ * -t prints the trace of the last request of every fixture in Chrome
+ * trace_event format.
+ * Inputs use transform_test format, so every fixture from tests/transform
+ * can be replayed as is:
+ *
+ *   for f in transform/{includes,foreach,copyof}/test*.in; do
+ *       echo ${f%.in}.xrl $f
+ *   done | xargs ../out/Release/xrlt_bench -m
+ */
+
+
+#define BENCH_BUFFER_SIZE   8192
+
+
+typedef struct {
+    size_t               id;
+    xrltTransformValue   val;
+    char                *data;
+} xrltBenchInput;
+
+
+typedef struct {
+    const char          *xrl;
+
+    xrltBenchInput      *input;
+    size_t               inputLen;
+
+    size_t               requests;
+    size_t               errors;
+    unsigned long long   time;
+    unsigned long long   callbacks;
+    unsigned long long   allocs;
+    unsigned long long   bytes;
+
+    xmlBufferPtr         profile;
+    xmlBufferPtr         trace;
+} xrltBenchFixture;
+
+
+static unsigned long long   xrltBenchAllocs;
+static unsigned long long   xrltBenchBytes;
+
+
+static void *
+xrltBenchMalloc(size_t size)
+{
+    xrltBenchAllocs++;
+    xrltBenchBytes += size;
+
+    return malloc(size);
+}
+
+
+static void *
+xrltBenchRealloc(void *ptr, size_t size)
+{
+    xrltBenchAllocs++;
+    xrltBenchBytes += size;
+
+    return realloc(ptr, size);
+}
+
+
+static char *
+xrltBenchStrdup(const char *str)
+{
+    size_t   len = strlen(str) + 1;
+    char    *ret;
+
+    ret = (char *)xrltBenchMalloc(len);
+
+    if (ret != NULL) {
+        memcpy(ret, str, len);
+    }
+
+    return ret;
+}
+
+
+static void
+xrltBenchErrorFunc(void *ctx, const char *msg, ...)
+{
+    // Errors are counted per request, don't flood the output.
+}
+
+
+static unsigned long long
+xrltBenchNanoseconds(void)
+{
+    struct timespec   ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000000000ULL +
+           (unsigned long long)ts.tv_nsec;
+}
+
+
+static void
+xrltBenchInputFree(xrltBenchFixture *f)
+{
+    size_t   i;
+
+    for (i = 0; i < f->inputLen; i++) {
+        free(f->input[i].data);
+    }
+
+    free(f->input);
+}
+
+
+static int
+xrltBenchInputRead(xrltBenchFixture *f, const char *in)
+{
+    FILE                *infile;
+    char                 data[BENCH_BUFFER_SIZE];
+    int                  id, j, k, l;
+    size_t               i, size = 0;
+    xrltBenchInput      *input;
+    xrltTransformValue  *val;
+
+    infile = fopen(in, "r");
+
+    if (infile == NULL) {
+        fprintf(stderr, "Failed to open '%s' file\n", in);
+        return 0;
+    }
+
+    // Same format as transform_test input.
+    while (fscanf(infile, "id:%d, type:%d, last:%d, error:%d, data:",
+                  &id, &j, &k, &l) == 4)
+    {
+        if (fgets(data, BENCH_BUFFER_SIZE - 1, infile) == NULL) {
+            data[0] = '\0';
+        }
+
+        if (f->inputLen == size) {
+            size = size == 0 ? 16 : size * 2;
+            input = (xrltBenchInput *)realloc(f->input,
+                                              sizeof(xrltBenchInput) * size);
+            if (input == NULL) {
+                fclose(infile);
+                return 0;
+            }
+
+            f->input = input;
+        }
+
+        input = &f->input[f->inputLen++];
+        memset(input, 0, sizeof(xrltBenchInput));
+
+        input->id = (size_t)id;
+        val = &input->val;
+
+        i = strlen(data);
+        if (i > 0 && data[i - 1] == '\n') {
+            data[--i] = '\0';
+        }
+
+        input->data = strdup(data);
+        if (input->data == NULL) {
+            fclose(infile);
+            return 0;
+        }
+
+        switch (j) {
+            case XRLT_TRANSFORM_VALUE_HEADER:
+            case XRLT_TRANSFORM_VALUE_COOKIE:
+            case XRLT_TRANSFORM_VALUE_STATUS:
+            case XRLT_TRANSFORM_VALUE_QUERYSTRING:
+            case XRLT_TRANSFORM_VALUE_BODY:
+                val->type = (xrltTransformValueType)j;
+                break;
+
+            case 100:
+                val->type = XRLT_TRANSFORM_VALUE_EMPTY;
+                break;
+
+            case 0:
+                val->type = XRLT_TRANSFORM_VALUE_ERROR;
+                break;
+
+            default:
+                fprintf(stderr, "Unexpected 'type' value in '%s'\n", in);
+                fclose(infile);
+                return 0;
+        }
+
+        val->bodyval.last = k ? TRUE : FALSE;
+
+        if (i > 0) {
+            switch (val->type) {
+                case XRLT_TRANSFORM_VALUE_HEADER:
+                case XRLT_TRANSFORM_VALUE_COOKIE:
+                    val->headerval.name.len = i / 2;
+                    val->headerval.name.data = input->data;
+                    val->headerval.val.len = i - val->headerval.name.len;
+                    val->headerval.val.data =
+                        input->data + val->headerval.name.len;
+                    break;
+
+                case XRLT_TRANSFORM_VALUE_STATUS:
+                    val->statusval.status = (size_t)atoi(input->data);
+                    break;
+
+                case XRLT_TRANSFORM_VALUE_QUERYSTRING:
+                    val->querystringval.val.len = i;
+                    val->querystringval.val.data = input->data;
+                    break;
+
+                case XRLT_TRANSFORM_VALUE_BODY:
+                    val->bodyval.val.len = i;
+                    val->bodyval.val.data = input->data;
+                    break;
+
+                case XRLT_TRANSFORM_VALUE_ERROR:
+                case XRLT_TRANSFORM_VALUE_EMPTY:
+                case XRLT_TRANSFORM_VALUE_TASK:
+                    break;
+            }
+        }
+
+        if (l) {
+            val->type = XRLT_TRANSFORM_VALUE_ERROR;
+        }
+    }
+
+    fclose(infile);
+
+    return 1;
+}
+
+
+static void
+xrltBenchDrain(xrltContextPtr ctx)
+{
+    xrltString               s, n, v, url, q, b;
+    xrltLogType              t;
+    xrltHeaderOutType        ht;
+    xrltHTTPMethod           m;
+    xrltSubrequestDataType   type;
+    xrltHeaderOutList        header;
+    size_t                   id;
+
+    while (xrltHeaderOutListShift(&ctx->header, &ht, &n, &v)) {
+        xrltStringClear(&n);
+        xrltStringClear(&v);
+    }
+
+    while (xrltLogListShift(&ctx->log, &t, &s)) {
+        xrltStringClear(&s);
+    }
+
+    while (xrltChunkListShift(&ctx->chunk, &s)) {
+        xrltStringClear(&s);
+    }
+
+    while (xrltSubrequestListShift(&ctx->sr, &id, &m, &type, &header, &url, &q,
+                                   &b))
+    {
+        xrltHeaderOutListClear(&header);
+        xrltStringClear(&url);
+        xrltStringClear(&q);
+        xrltStringClear(&b);
+    }
+}
+
+
+static int
+xrltBenchStep(xrltContextPtr ctx, size_t id, xrltTransformValue *val)
+{
+    int                  ret;
+    xrltTransformValue   tval;
+    xrltTaskFunction     run;
+    void                *data;
+
+    ret = xrltTransform(ctx, id, val);
+
+    while (!(ret & XRLT_STATUS_ERROR)) {
+        xrltBenchDrain(ctx);
+
+        if (ret & XRLT_STATUS_TASK) {
+            // Run the tasks in place, the way a caller without a thread
+            // pool would.
+            while (xrltTaskListShift(&ctx->task, &id, &run, &data)) {
+                run(data);
+
+                memset(&tval, 0, sizeof(tval));
+                tval.type = XRLT_TRANSFORM_VALUE_TASK;
+
+                ret = xrltTransform(ctx, id, &tval);
+
+                if (ret & XRLT_STATUS_ERROR) {
+                    return ret;
+                }
+
+                xrltBenchDrain(ctx);
+            }
+        } else if (!(ret & XRLT_STATUS_YIELD)) {
+            break;
+        }
+
+        memset(&tval, 0, sizeof(tval));
+        tval.type = XRLT_TRANSFORM_VALUE_EMPTY;
+
+        ret = xrltTransform(ctx, 0, &tval);
+    }
+
+    return ret;
+}
+
+
+static int
+xrltBenchRun(xrltBenchFixture *f, size_t iterations)
+{
+    xmlDocPtr             doc;
+    xrltRequestsheetPtr   sheet;
+    xrltContextPtr        ctx;
+    xmlChar              *params[5];
+    size_t                i, j;
+    int                   ret;
+    unsigned long long    started, allocs, bytes;
+
+    doc = xmlReadFile(f->xrl, NULL, 0);
+
+    if (doc == NULL) {
+        fprintf(stderr, "Failed to read '%s' file\n", f->xrl);
+        return 0;
+    }
+
+    sheet = xrltRequestsheetCreate(doc);
+
+    if (sheet == NULL) {
+        xmlFreeDoc(doc);
+        fprintf(stderr, "Failed to compile '%s' file\n", f->xrl);
+        return 0;
+    }
+
+    params[0] = (xmlChar *)"param1";
+    params[1] = (xmlChar *)"val1";
+    params[2] = (xmlChar *)"param2";
+    params[3] = (xmlChar *)"val2";
+    params[4] = NULL;
+
+    allocs = xrltBenchAllocs;
+    bytes = xrltBenchBytes;
+    started = xrltBenchNanoseconds();
+
+    for (i = 0; i < iterations; i++) {
+        ctx = xrltContextCreate(sheet, params);
+
+        if (ctx == NULL) {
+            f->errors++;
+            continue;
+        }
+
+        if (f->profile != NULL && i == iterations - 1) {
+            xrltProfileEnable(ctx);
+        }
+
+        if (f->trace != NULL && i == iterations - 1) {
+            xrltTraceEnable(ctx);
+        }
+
+        for (j = 0; j < f->inputLen; j++) {
+            ret = xrltBenchStep(ctx, f->input[j].id, &f->input[j].val);
+
+            if (ret & XRLT_STATUS_ERROR) {
+                f->errors++;
+                break;
+            }
+        }
+
+        xrltBenchDrain(ctx);
+
+        if (ctx->profile != NULL) {
+            xrltProfileDump(ctx, f->profile);
+        }
+
+        if (ctx->trace != NULL) {
+            xrltTraceDump(ctx, f->trace);
+        }
+
+        f->callbacks += ctx->callbacks;
+        f->requests++;
+
+        xrltContextFree(ctx);
+    }
+
+    f->time = xrltBenchNanoseconds() - started;
+    f->allocs = xrltBenchAllocs - allocs;
+    f->bytes = xrltBenchBytes - bytes;
+
+    xrltRequestsheetFree(sheet);
+
+    return 1;
+}
+
+
+static void
+xrltBenchPrint(xrltBenchFixture *f, int machine, long rss)
+{
+    double   n = f->requests > 0 ? (double)f->requests : 1;
+
+    if (machine) {
+        printf("{\"fixture\":\"%s\",\"requests\":%zu,\"errors\":%zu,"
+               "\"ns_per_request\":%.0f,\"callbacks_per_request\":%.1f,"
+               "\"allocs_per_request\":%.1f,\"bytes_per_request\":%.0f,"
+               "\"peak_rss_kb\":%ld}\n",
+               f->xrl, f->requests, f->errors, (double)f->time / n,
+               (double)f->callbacks / n, (double)f->allocs / n,
+               (double)f->bytes / n, rss);
+    } else {
+        printf("%s\n"
+               "    requests:   %zu (%zu errors)\n"
+               "    time:       %.0f ns/request\n"
+               "    callbacks:  %.1f/request\n"
+               "    allocs:     %.1f/request (%.0f bytes/request)\n"
+               "    peak RSS:   %ld KB\n",
+               f->xrl, f->requests, f->errors, (double)f->time / n,
+               (double)f->callbacks / n, (double)f->allocs / n,
+               (double)f->bytes / n, rss);
+    }
+}
+
+
+static long
+xrltBenchPeakRSS(void)
+{
+    struct rusage   usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+
+int main(int argc, char *argv[])
+{
+    size_t              iterations = 1000;
+    int                 machine = 0;
+    int                 profile = 0;
+    int                 trace = 0;
+    int                 i, ret = 0;
+    xrltBenchFixture    f;
+
+    // Count every allocation made by libxml2, libxslt and libxrlt.
+    xmlMemSetup(free, xrltBenchMalloc, xrltBenchRealloc, xrltBenchStrdup);
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            iterations = (size_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            machine = 1;
+        } else if (strcmp(argv[i], "-p") == 0) {
+            profile = 1;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            trace = 1;
+        } else {
+            break;
+        }
+    }
+
+    if (i == argc || (argc - i) % 2 != 0 || iterations == 0) {
+        fprintf(stderr, "Usage: %s [-n iterations] [-m] [-p] [-t] "
+                        "test.xrl test.in [test.xrl test.in ...]\n", argv[0]);
+        return 1;
+    }
+
+    xmlInitParser();
+    xrltInit();
+
+    xrltSetGenericErrorFunc(NULL, xrltBenchErrorFunc);
+
+    for (; i < argc; i += 2) {
+        memset(&f, 0, sizeof(f));
+        f.xrl = argv[i];
+        f.profile = profile ? xmlBufferCreate() : NULL;
+        f.trace = trace ? xmlBufferCreate() : NULL;
+
+        if (!xrltBenchInputRead(&f, argv[i + 1]) ||
+            !xrltBenchRun(&f, iterations))
+        {
+            ret = 1;
+        } else {
+            xrltBenchPrint(&f, machine, xrltBenchPeakRSS());
+
+            if (f.profile != NULL) {
+                printf("%s", (const char *)xmlBufferContent(f.profile));
+            }
+
+            if (f.trace != NULL) {
+                printf("%s", (const char *)xmlBufferContent(f.trace));
+            }
+        }
+
+        if (f.profile != NULL) {
+            xmlBufferFree(f.profile);
+        }
+
+        if (f.trace != NULL) {
+            xmlBufferFree(f.trace);
+        }
+
+        xrltBenchInputFree(&f);
+    }
+
+    xrltCleanup();
+    xmlCleanupParser();
+
+    return ret;
+}
@@ -26,6 +26,29 @@ xrltTestErrorFunc(void *ctx, const char *msg, ...)
 }
 
 
+static int
+setOption(xrltContextPtr ctx, const char *name, int value)
+{
+    // Context settings come from the 'option:name:value' lines in the
+    // beginning of the input file.
+    if (strcmp(name, "schedule") == 0) {
+        ctx->schedule = value;
+    } else if (strcmp(name, "budget") == 0) {
+        ctx->budgetCallbacks = (size_t)value;
+    } else if (strcmp(name, "offload") == 0) {
+        ctx->offload = value ? TRUE : FALSE;
+    } else if (strcmp(name, "parse") == 0) {
+        ctx->parseThreshold = (size_t)value;
+    } else if (strcmp(name, "profile") == 0) {
+        return value ? xrltProfileEnable(ctx) : 1;
+    } else {
+        return 0;
+    }
+
+    return 1;
+}
+
+
 char *
 dumpResult(xrltContextPtr ctx, int ret, char *out)
 {
@@ -95,6 +118,18 @@ dumpResult(xrltContextPtr ctx, int ret, char *out)
         out += strlen(buf);
     }
 
+    if (ret & XRLT_STATUS_YIELD) {
+        sprintf(buf, "XRLT_STATUS_YIELD\n");
+        sprintf(out, "%s", buf);
+        out += strlen(buf);
+    }
+
+    if (ret & XRLT_STATUS_TASK) {
+        sprintf(buf, "XRLT_STATUS_TASK\n");
+        sprintf(out, "%s", buf);
+        out += strlen(buf);
+    }
+
     while (xrltHeaderOutListShift(&ctx->header, &ht, &n, &v)) {
         switch (ht) {
             case XRLT_HEADER_OUT_COOKIE:
@@ -229,6 +264,50 @@ dumpResult(xrltContextPtr ctx, int ret, char *out)
 }
 
 
+char *
+dumpProfile(xrltContextPtr ctx, const char *xrl, char *out)
+{
+    // Times differ from run to run, so only the stacks are dumped. File
+    // names are made relative to the requestsheet's directory.
+    xmlBufferPtr   buf;
+    const char    *dir = strrchr(xrl, '/');
+    size_t         dirlen = dir == NULL ? 0 : (size_t)(dir - xrl) + 1;
+    const char    *line, *end, *time;
+
+    buf = xmlBufferCreate();
+
+    if (buf == NULL || !xrltProfileDump(ctx, buf)) {
+        xmlBufferFree(buf);
+        return out;
+    }
+
+    for (line = (const char *)xmlBufferContent(buf);
+         (end = strchr(line, '\n')) != NULL;
+         line = end + 1)
+    {
+        for (time = end; time > line && *time != ' '; time--);
+
+        out += sprintf(out, "profile: ");
+
+        while (line < time) {
+            if (dirlen > 0 && strncmp(line, xrl, dirlen) == 0) {
+                line += dirlen;
+            } else {
+                *out++ = *line++;
+            }
+        }
+
+        *out++ = '\n';
+    }
+
+    *out = '\0';
+
+    xmlBufferFree(buf);
+
+    return out;
+}
+
+
 void
 test_xrltTransform(const char *xrl, const char *in, const char *out)
 {
@@ -242,10 +321,13 @@ test_xrltTransform(const char *xrl, const char *in, const char *out)
 
     xrltContextPtr           ctx;
     char                     data[TEST_BUFFER_SIZE];
+    char                     name[32];
     size_t                   id;
     int                      i, j, k, l;
     xrltTransformValue       val;
     xmlChar                 *params[5];
+    xrltTaskFunction         run;
+    void                    *task;
 
     memset(indata, 0, TEST_BUFFER_SIZE);
     memset(outdata, 0, TEST_BUFFER_SIZE);
@@ -302,6 +384,13 @@ test_xrltTransform(const char *xrl, const char *in, const char *out)
 
     pos = indata;
 
+    while (fscanf(infile, "option:%31[^:]:%d\n", name, &j) == 2) {
+        if (!setOption(ctx, name, j)) {
+            xrltTestFailurePush((char *)"Unexpected option");
+            TEST_FAILED;
+        }
+    }
+
     id = 0;
     memset(&val, 0, sizeof(xrltTransformValue));
 
@@ -370,6 +459,7 @@ test_xrltTransform(const char *xrl, const char *in, const char *out)
 
                 case XRLT_TRANSFORM_VALUE_ERROR:
                 case XRLT_TRANSFORM_VALUE_EMPTY:
+                case XRLT_TRANSFORM_VALUE_TASK:
                     xrltTestFailurePush((char *)"Unexpected type");
                     TEST_FAILED;
             }
@@ -382,9 +472,35 @@ test_xrltTransform(const char *xrl, const char *in, const char *out)
         i = xrltTransform(ctx, id, &val);
 
         pos = dumpResult(ctx, i, pos);
+
+        while (TRUE) {
+            memset(&val, 0, sizeof(val));
+
+            if (xrltTaskListShift(&ctx->task, &id, &run, &task)) {
+                // Run the offloaded work in place, like a thread pool
+                // would do.
+                run(task);
+
+                val.type = XRLT_TRANSFORM_VALUE_TASK;
+            } else if (i & XRLT_STATUS_YIELD) {
+                // The budget is exhausted, call again right away.
+                id = 0;
+                val.type = XRLT_TRANSFORM_VALUE_EMPTY;
+            } else {
+                break;
+            }
+
+            i = xrltTransform(ctx, id, &val);
+
+            pos = dumpResult(ctx, i, pos);
+        }
     }
     fclose(infile);
 
+    if (ctx->profile != NULL) {
+        pos = dumpProfile(ctx, xrl, pos);
+    }
+
     //xmlDocFormatDump(stderr, ctx->responseDoc, 1);
 
 
@@ -0,0 +1,103 @@
+/*
+ * Copyright Marat Abdullin (https://github.com/hoho)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "transform.h"
+
+
+xrltBool
+xrltTraceEnable(xrltContextPtr ctx)
+{
+    if (ctx == NULL) { return FALSE; }
+
+    if (ctx->trace != NULL) { return TRUE; }
+
+    ctx->trace = xmlBufferCreate();
+
+    if (ctx->trace == NULL) {
+        ERROR_OUT_OF_MEMORY(ctx, NULL, NULL);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+static void
+xrltTraceEscape(xmlBufferPtr buf, const xmlChar *str)
+{
+    const xmlChar  *start = str;
+    char            esc[8];
+
+    while (*str != '\0') {
+        if (*str == '"' || *str == '\\' || *str < 0x20) {
+            if (str > start) {
+                xmlBufferAdd(buf, start, str - start);
+            }
+
+            snprintf(esc, sizeof(esc), "\\u%04x", *str);
+            xmlBufferCCat(buf, esc);
+
+            start = str + 1;
+        }
+
+        str++;
+    }
+
+    if (str > start) {
+        xmlBufferAdd(buf, start, str - start);
+    }
+}
+
+
+void
+xrltTraceSpan(xrltContextPtr ctx, const char *cat, const xmlChar *name,
+              size_t tid, size_t started, const char *args)
+{
+    xmlBufferPtr   buf = ctx->trace;
+    size_t         now;
+    char           tmp[128];
+
+    if (buf == NULL || started == 0) { return; }
+
+    now = xrltTimeNanoseconds();
+
+    // Events are separated right away, xrltTraceDump() only wraps them.
+    if (xmlBufferLength(buf) > 0) {
+        xmlBufferCCat(buf, ",\n");
+    }
+
+    xmlBufferCCat(buf, "{\"name\":\"");
+    xrltTraceEscape(buf, name != NULL ? name : (const xmlChar *)cat);
+
+    snprintf(tmp, sizeof(tmp),
+             "\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%zu.%03zu,"
+             "\"dur\":%zu.%03zu,\"pid\":1,\"tid\":%zu",
+             cat, started / 1000, started % 1000,
+             (now - started) / 1000, (now - started) % 1000, tid);
+    xmlBufferCCat(buf, tmp);
+
+    if (args != NULL) {
+        xmlBufferCCat(buf, ",\"args\":");
+        xmlBufferCCat(buf, args);
+    }
+
+    xmlBufferCCat(buf, "}");
+}
+
+
+xrltBool
+xrltTraceDump(xrltContextPtr ctx, xmlBufferPtr buf)
+{
+    if (ctx == NULL || buf == NULL || ctx->trace == NULL) { return FALSE; }
+
+    xmlBufferCCat(buf, "{\"traceEvents\":[\n");
+    xmlBufferAdd(buf, xmlBufferContent(ctx->trace),
+                 xmlBufferLength(ctx->trace));
+    xmlBufferCCat(buf, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    return TRUE;
+}
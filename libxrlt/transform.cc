@@ -3,6 +3,7 @@
  */
 
 #include <libxml/tree.h>
+#include <libxml/chvalid.h>
 
 #include "transform.h"
 #include "response.h"
@@ -16,6 +17,7 @@
 #include "headers.h"
 #include "function.h"
 #include "foreach.h"
+#include "key.h"
 
 
 static xmlHashTablePtr xrltRegisteredElements = NULL;
@@ -54,8 +56,8 @@ xrltEmptyTransform(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
 }
 
 
-static inline xrltBool
-xrltRegisterBuiltinElementsIfUnregistered(void)
+xrltBool
+xrltRegisterBuiltinElements(void)
 {
     if (xrltRegisteredElements != NULL) { return TRUE; }
 
@@ -64,7 +66,7 @@ xrltRegisterBuiltinElementsIfUnregistered(void)
     if (xrltRegisteredElements == NULL) {
         xrltTransformError(
             NULL, NULL, NULL,
-            "xrltRegisterBuiltinElementsIfUnregistered: Hash creation failed\n"
+            "xrltRegisterBuiltinElements: Hash creation failed\n"
         );
         return FALSE;
     }
@@ -209,12 +211,24 @@ xrltRegisterBuiltinElementsIfUnregistered(void)
                                xrltApplyFree,
                                xrltApplyTransform);
 
+    ret &= xrltElementRegister(XRLT_NS, (const xmlChar *)"key",
+                               XRLT_REGISTER_TOPLEVEL | XRLT_COMPILE_PASS1,
+                               xrltKeyCompile,
+                               xrltKeyFree,
+                               xrltEmptyTransform);
+
     ret &= xrltElementRegister(XRLT_NS, (const xmlChar *)"for-each",
                                XRLT_COMPILE_PASS2,
                                xrltForEachCompile,
                                xrltForEachFree,
                                xrltForEachTransform);
 
+    ret &= xrltElementRegister(XRLT_NS, (const xmlChar *)"sort",
+                               XRLT_COMPILE_PASS2,
+                               xrltSortCompile,
+                               xrltSortFree,
+                               xrltEmptyTransform);
+
     if (!ret) {
         xrltUnregisterBuiltinElements();
         return FALSE;
@@ -231,7 +245,7 @@ xrltElementRegister(const xmlChar *ns, const xmlChar *name,
                     xrltTransformFunction transform)
 {
     if (name == NULL || transform == NULL) { return FALSE; }
-    if (!xrltRegisterBuiltinElementsIfUnregistered()) { return FALSE; }
+    if (!xrltRegisterBuiltinElements()) { return FALSE; }
 
     xrltElementPtr   elem;
     const xmlChar   *pass1, *pass2;
@@ -281,7 +295,7 @@ xrltBool
 xrltElementCompile(xrltRequestsheetPtr sheet, xmlNodePtr first)
 {
     if (sheet == NULL || first == NULL) { return FALSE; }
-    if (!xrltRegisterBuiltinElementsIfUnregistered()) { return FALSE; }
+    if (!xrltRegisterBuiltinElements()) { return FALSE; }
 
     xrltCompilePass           pass = sheet->pass;
     const xmlChar            *ns;
@@ -329,6 +343,10 @@ xrltElementCompile(xrltRequestsheetPtr sheet, xmlNodePtr first)
 
         ASSERT_NODE_DATA(first, n);
 
+        if (n->id == 0) {
+            n->id = ++sheet->nodeCount;
+        }
+
         elem = (xrltElementPtr)xmlHashLookup3(
             xrltRegisteredElements, name, _pass, ns
         );
@@ -365,18 +383,35 @@ xrltElementCompile(xrltRequestsheetPtr sheet, xmlNodePtr first)
 }
 
 
-xmlXPathObjectPtr
-xrltVariableLookupFunc(void *ctxt, const xmlChar *name, const xmlChar *ns_uri)
+static inline xmlNodePtr
+xrltVariableNotReady(xmlXPathObjectPtr val)
+{
+    xmlNodePtr        node;
+    xrltNodeDataPtr   n;
+
+    if (val->type == XPATH_NODESET) {
+        node = xmlXPathNodeSetItem(val->nodesetval, 0);
+
+        if (node != NULL) {
+            n = (xrltNodeDataPtr)node->_private;
+
+            if (n != NULL && n->count > 0) { return node; }
+        }
+    }
+
+    return NULL;
+}
+
+
+static xmlXPathObjectPtr
+xrltVariableFind(xrltContextPtr ctx, const xmlChar *name)
 {
     xmlChar              id[sizeof(xmlNodePtr) * 7]; // TODO: Count actual size.
     xmlXPathObjectPtr    ret;
-    xrltContextPtr       ctx = (xrltContextPtr)ctxt;
     size_t               varScope;
     xmlNodePtr           node, insert;
     xrltNodeDataPtr      n;
 
-    if (ctx == NULL) { return NULL; }
-
     varScope = ctx->varScope;
     node = ctx->varContext;
     insert = ctx->insert;
@@ -391,23 +426,7 @@ xrltVariableLookupFunc(void *ctxt, const xmlChar *name, const xmlChar *ns_uri)
             ret = (xmlXPathObjectPtr)xmlHashLookup2(ctx->xpath->varHash,
                                                     id, name);
 
-            if (ret != NULL) {
-                if (ret->type == XPATH_NODESET) {
-                    node = xmlXPathNodeSetItem(ret->nodesetval, 0);
-
-                    if (node != NULL) {
-                        n = (xrltNodeDataPtr)node->_private;
-
-                        if (n != NULL && n->count > 0) {
-                            ctx->xpathWait = node;
-
-                            return xmlXPathNewNodeSet(NULL);
-                        }
-                    }
-                }
-
-                return xmlXPathObjectCopy(ret);
-            }
+            if (ret != NULL) { return ret; }
         }
 
         if (n->parentScope) {
@@ -441,6 +460,154 @@ xrltVariableLookupFunc(void *ctxt, const xmlChar *name, const xmlChar *ns_uri)
 }
 
 
+xmlXPathObjectPtr
+xrltVariableLookupFunc(void *ctxt, const xmlChar *name, const xmlChar *ns_uri)
+{
+    xrltContextPtr       ctx = (xrltContextPtr)ctxt;
+    xmlXPathObjectPtr    ret;
+    xmlNodePtr           node;
+
+    if (ctx == NULL) { return NULL; }
+
+    ret = xrltVariableFind(ctx, name);
+
+    if (ret == NULL) { return NULL; }
+
+    node = xrltVariableNotReady(ret);
+
+    if (node != NULL) {
+        ctx->xpathWait = node;
+
+        return xmlXPathNewNodeSet(NULL);
+    }
+
+    return xmlXPathObjectCopy(ret);
+}
+
+
+xrltBool
+xrltXPathEvalFast(xrltContextPtr ctx, xrltXPathExpr *expr,
+                  xmlXPathObjectPtr *ret)
+{
+    // Returns FALSE when the expression should go to the XPath engine.
+    xrltXPathCompiled  *compiled = expr->compiled;
+    xmlXPathObjectPtr   val;
+    xmlNodeSetPtr       from, to;
+    xmlNodePtr          node, child;
+    xmlChar           **name;
+    int                 i;
+
+    switch (compiled->fast) {
+        case XRLT_XPATH_GENERIC:
+            return FALSE;
+
+        case XRLT_XPATH_STRING:
+            *ret = xmlXPathNewString(compiled->strval);
+            return *ret != NULL;
+
+        case XRLT_XPATH_BOOLEAN:
+            *ret = xmlXPathNewBoolean(compiled->boolval);
+            return *ret != NULL;
+
+        case XRLT_XPATH_VARIABLE:
+            break;
+    }
+
+    val = xrltVariableFind(ctx, compiled->path[0]);
+
+    // Undefined variables are reported by the XPath engine.
+    if (val == NULL) { return FALSE; }
+
+    ctx->xpathWait = xrltVariableNotReady(val);
+
+    if (ctx->xpathWait != NULL) {
+        *ret = NULL;
+        return TRUE;
+    }
+
+    if (compiled->path[1] == NULL) {
+        *ret = xmlXPathObjectCopy(val);
+        return *ret != NULL;
+    }
+
+    if (val->type != XPATH_NODESET) { return FALSE; }
+
+    from = val->nodesetval;
+
+    for (name = compiled->path + 1; *name != NULL; name++) {
+        to = xmlXPathNodeSetCreate(NULL);
+
+        for (i = 0; to != NULL && from != NULL && i < from->nodeNr; i++) {
+            node = from->nodeTab[i];
+
+            if (node->type != XML_ELEMENT_NODE &&
+                node->type != XML_DOCUMENT_NODE)
+            {
+                continue;
+            }
+
+            for (child = node->children; child != NULL; child = child->next)
+            {
+                if (child->type == XML_ELEMENT_NODE && child->ns == NULL &&
+                    xmlStrEqual(child->name, *name))
+                {
+                    xmlXPathNodeSetAddUnique(to, child);
+                }
+            }
+        }
+
+        if (from != val->nodesetval) { xmlXPathFreeNodeSet(from); }
+
+        if (to == NULL) { return FALSE; }
+
+        from = to;
+    }
+
+    if (val->nodesetval != NULL && val->nodesetval->nodeNr > 1) {
+        // Children of nested nodes might come out of document order, the
+        // nodes of one step are never nested.
+        xmlXPathNodeSetSort(from);
+    }
+
+    *ret = xmlXPathWrapNodeSet(from);
+
+    if (*ret == NULL) {
+        xmlXPathFreeNodeSet(from);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+xmlNodePtr
+xrltXPathNotReady(xrltContextPtr ctx, xrltXPathExpr *expr)
+{
+    // Returns the first variable of the expression to wait for, so that
+    // the expression is evaluated once all of them are ready instead of
+    // once per variable.
+    xmlXPathObjectPtr   val;
+    xmlNodePtr          node;
+    xmlChar           **name;
+
+    if (expr->compiled == NULL || expr->compiled->vars == NULL) {
+        return NULL;
+    }
+
+    for (name = expr->compiled->vars; *name != NULL; name++) {
+        val = xrltVariableFind(ctx, *name);
+
+        if (val == NULL) { continue; }
+
+        node = xrltVariableNotReady(val);
+
+        if (node != NULL) { return node; }
+    }
+
+    return NULL;
+}
+
+
 static xrltBool
 xrltCopyNonXRLT(xrltContextPtr ctx, void *comp, xmlNodePtr insert, void *data)
 {
@@ -489,10 +656,15 @@ xrltElementTransform(xrltContextPtr ctx, xmlNodePtr first, xmlNodePtr insert)
     if (ctx == NULL) { return FALSE; }
 
     xrltNodeDataPtr   n;
+    xmlNodePtr        src = ctx->src;
 
     while (first != NULL) {
         ASSERT_NODE_DATA(first, n);
 
+        // Callbacks scheduled by this element's callbacks are run for it
+        // too, unless they are transforming subtrees of their own.
+        ctx->src = first;
+
         if (!n->xrlt) {
             SCHEDULE_CALLBACK(
                 ctx, &ctx->tcb, xrltCopyNonXRLT, NULL, insert, first
@@ -503,9 +675,137 @@ xrltElementTransform(xrltContextPtr ctx, xmlNodePtr first, xmlNodePtr insert)
             );
         }
 
+        if (n->release != NULL) {
+            SCHEDULE_CALLBACK(
+                ctx, &ctx->tcb, xrltVariableReleaseMark, n->release, insert,
+                NULL
+            );
+        }
+
         first = first->next;
     }
 
+    ctx->src = src;
+
+    return TRUE;
+}
+
+
+static xrltBool
+xrltCopyNonXRLTInline(xrltContextPtr ctx, xmlNodePtr node, xmlNodePtr insert)
+{
+    xmlNodePtr   newinsert;
+
+    newinsert = xmlDocCopyNode(node, insert->doc, 2);
+
+    if (newinsert == NULL) {
+        ERROR_CREATE_NODE(ctx, NULL, node);
+
+        return FALSE;
+    }
+
+    if (xmlAddChild(insert, newinsert) == NULL) {
+        xmlFreeNode(newinsert);
+
+        ERROR_ADD_NODE(ctx, NULL, node);
+
+        return FALSE;
+    }
+
+    // The children's first calls are done by the time this returns, no
+    // need to hold the counter meanwhile.
+    return xrltElementTransformInline(ctx, node->children, newinsert);
+}
+
+
+xrltBool
+xrltElementTransformInline(xrltContextPtr ctx, xmlNodePtr first,
+                           xmlNodePtr insert)
+{
+    // Makes the first calls right away instead of scheduling them, for the
+    // subtrees xrltCanTransformInline() accepts. Whatever has to wait
+    // schedules its next calls as usual.
+    xrltNodeDataPtr   n;
+    xmlNodePtr        oldInsert = ctx->insert;
+    size_t            oldVarScope = ctx->varScope;
+    xmlNodePtr        oldContext = ctx->xpathContext;
+    int               oldContextSize = ctx->xpathContextSize;
+    int               oldProximityPosition = ctx->xpathProximityPosition;
+    xmlNodePtr        oldSrc = ctx->src;
+    xrltBool          ret = TRUE;
+    size_t            profiled = 0;
+
+    for (; first != NULL && ret; first = first->next) {
+        ASSERT_NODE_DATA(first, n);
+
+        ctx->insert = insert;
+        ctx->src = first;
+
+        // Counted as if they were scheduled, the caller's time doesn't
+        // include them.
+        if (ctx->profile != NULL) {
+            profiled = xrltProfileStart(ctx);
+        }
+
+        if (!n->xrlt) {
+            ret = first->type == XML_ELEMENT_NODE
+                ?
+                xrltCopyNonXRLTInline(ctx, first, insert)
+                :
+                xrltCopyNonXRLT(ctx, NULL, insert, first);
+        } else {
+            ret = n->transform(ctx, n->data, insert, NULL);
+        }
+
+        if (ctx->profile != NULL) {
+            xrltProfileAdd(ctx, first, profiled);
+        }
+
+        ctx->callbacks++;
+
+        ctx->insert = oldInsert;
+        ctx->varScope = oldVarScope;
+        ctx->xpathContext = oldContext;
+        ctx->xpathContextSize = oldContextSize;
+        ctx->xpathProximityPosition = oldProximityPosition;
+    }
+
+    ctx->src = oldSrc;
+
+    return ret;
+}
+
+
+xrltBool
+xrltCanTransformInline(xmlNodePtr first)
+{
+    // Elements that do their first call the same way wherever it is made
+    // from. The others (includes, function calls, logs, headers) rely on
+    // the order of the queue.
+    xrltNodeDataPtr   n;
+
+    for (; first != NULL; first = first->next) {
+        n = (xrltNodeDataPtr)first->_private;
+
+        if (n == NULL) { return FALSE; }
+
+        if (!n->xrlt) {
+            if (xrltIsXRLTNamespace(first) ||
+                !xrltCanTransformInline(first->children))
+            {
+                return FALSE;
+            }
+        } else if (n->transform != xrltValueOfTransform &&
+                   n->transform != xrltCopyOfTransform &&
+                   n->transform != xrltIfTransform &&
+                   n->transform != xrltChooseTransform &&
+                   n->transform != xrltForEachTransform &&
+                   n->transform != xrltVariableTransform)
+        {
+            return FALSE;
+        }
+    }
+
     return TRUE;
 }
 
@@ -526,6 +826,431 @@ xrltHasXRLTElement(xmlNodePtr node)
 }
 
 
+static xrltBool
+xrltXPathCollectVariables(const xmlChar *str, xrltXPathCompiled *compiled)
+{
+    // Scans the expression for $name outside of the string literals. The
+    // expression is compiled already, so it is well-formed.
+    const xmlChar  *c = str;
+    const xmlChar  *name;
+    xmlChar       **tmp;
+    xmlChar         quote;
+    xrltBool        prefixed;
+    int             len = 0;
+    int             i;
+
+    while (*c != '\0') {
+        if (*c == '"' || *c == '\'') {
+            quote = *c++;
+
+            while (*c != '\0' && *c != quote) { c++; }
+
+            if (*c != '\0') { c++; }
+
+            continue;
+        }
+
+        if (*c++ != '$') { continue; }
+
+        while (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n') { c++; }
+
+        for (name = c, prefixed = FALSE; xrltIsNameChar(*c); c++) {
+            if (*c == ':') { prefixed = TRUE; }
+        }
+
+        if (c == name || prefixed) {
+            // Prefixed variables are looked up by the evaluation only.
+            continue;
+        }
+
+        for (i = 0; i < len; i++) {
+            if (xmlStrncmp(compiled->vars[i], name, c - name) == 0 &&
+                compiled->vars[i][c - name] == '\0')
+            {
+                break;
+            }
+        }
+
+        if (i < len) { continue; }
+
+        tmp = (xmlChar **)xmlRealloc(compiled->vars,
+                                     sizeof(xmlChar *) * (len + 2));
+        if (tmp == NULL) { return FALSE; }
+
+        compiled->vars = tmp;
+        compiled->vars[len + 1] = NULL;
+        compiled->vars[len] = xmlStrndup(name, c - name);
+
+        if (compiled->vars[len++] == NULL) { return FALSE; }
+    }
+
+    return TRUE;
+}
+
+
+static inline xrltBool
+xrltIsNameStartChar(xmlChar c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' ||
+           c >= 0x80;
+}
+
+
+static xrltBool
+xrltXPathCompileFast(const xmlChar *str, xrltXPathCompiled *compiled)
+{
+    // Recognizes the expressions that don't need the XPath engine. Anything
+    // else (including what is just written differently) stays generic.
+    const xmlChar  *start;
+    const xmlChar  *end;
+    const xmlChar  *c;
+    int             len = 0;
+    int             i;
+
+    for (start = str; xmlIsBlank_ch(*start); start++);
+    for (end = start + xmlStrlen(start); end > start && xmlIsBlank_ch(end[-1]);
+         end--);
+
+    if (end - start >= 2 && (*start == '\'' || *start == '"') &&
+        end[-1] == *start)
+    {
+        for (c = start + 1; c < end - 1 && *c != *start; c++);
+
+        if (c < end - 1) { return TRUE; }
+
+        compiled->strval = xmlStrndup(start + 1, end - start - 2);
+        if (compiled->strval == NULL) { return FALSE; }
+
+        compiled->fast = XRLT_XPATH_STRING;
+
+        return TRUE;
+    }
+
+    if (end - start == 6 && xmlStrncmp(start, BAD_CAST "true()", 6) == 0) {
+        compiled->fast = XRLT_XPATH_BOOLEAN;
+        compiled->boolval = TRUE;
+
+        return TRUE;
+    }
+
+    if (end - start == 7 && xmlStrncmp(start, BAD_CAST "false()", 7) == 0) {
+        compiled->fast = XRLT_XPATH_BOOLEAN;
+        compiled->boolval = FALSE;
+
+        return TRUE;
+    }
+
+    if (*start != '$') { return TRUE; }
+
+    // Unprefixed names separated with single slashes only.
+    for (c = start + 1; c < end; c++) {
+        if (!xrltIsNameStartChar(*c)) { return TRUE; }
+
+        while (c < end && *c != '/') {
+            if (*c == ':' || !xrltIsNameChar(*c)) { return TRUE; }
+            c++;
+        }
+
+        len++;
+    }
+
+    if (len == 0 || end[-1] == '/') { return TRUE; }
+
+    XRLT_MALLOC(NULL, NULL, NULL, compiled->path, xmlChar **,
+                sizeof(xmlChar *) * (len + 1), FALSE);
+
+    for (c = start + 1, i = 0; i < len; i++, c++) {
+        for (start = c; c < end && *c != '/'; c++);
+
+        compiled->path[i] = xmlStrndup(start, c - start);
+        if (compiled->path[i] == NULL) { return FALSE; }
+    }
+
+    compiled->fast = XRLT_XPATH_VARIABLE;
+
+    return TRUE;
+}
+
+
+xrltBool
+xrltXPathCompile(xrltRequestsheetPtr sheet, const xmlChar *str,
+                 xrltXPathExpr *expr)
+{
+    // Same expressions are compiled once per requestsheet (with imports),
+    // the requestsheet keeps a reference too.
+    xrltXPathCompiled  *compiled;
+
+    if (sheet->xpath == NULL) {
+        sheet->xpath = xmlHashCreate(64);
+
+        if (sheet->xpath == NULL) { return FALSE; }
+    }
+
+    compiled = (xrltXPathCompiled *)xmlHashLookup(sheet->xpath, str);
+
+    if (compiled == NULL) {
+        XRLT_MALLOC(NULL, sheet, NULL, compiled, xrltXPathCompiled *,
+                    sizeof(xrltXPathCompiled), FALSE);
+
+        compiled->expr = xmlXPathCompile(str);
+
+        if (compiled->expr == NULL) {
+            xmlFree(compiled);
+            return FALSE;
+        }
+
+        compiled->refs = 1;
+
+        if (!xrltXPathCollectVariables(str, compiled) ||
+            !xrltXPathCompileFast(str, compiled) ||
+            xmlHashAddEntry(sheet->xpath, str, compiled))
+        {
+            xrltXPathRelease(compiled);
+            return FALSE;
+        }
+    }
+
+    compiled->refs++;
+
+    expr->expr = compiled->expr;
+    expr->compiled = compiled;
+
+    return TRUE;
+}
+
+
+static const char *xrltXPathConstantFunctions[] = {
+    "true", "false", "not", "boolean", "number", "string", "concat",
+    "contains", "starts-with", "substring", "substring-before",
+    "substring-after", "string-length", "normalize-space", "translate",
+    "floor", "ceiling", "round", NULL
+};
+
+
+static inline xrltBool
+xrltXPathIsOperatorName(const xmlChar *name, int len)
+{
+    if (len == 2) { return xmlStrncmp(name, BAD_CAST "or", 2) == 0; }
+
+    return len == 3 && (xmlStrncmp(name, BAD_CAST "and", 3) == 0 ||
+                        xmlStrncmp(name, BAD_CAST "div", 3) == 0 ||
+                        xmlStrncmp(name, BAD_CAST "mod", 3) == 0);
+}
+
+
+static xrltBool
+xrltXPathIsConstant(const xmlChar *str)
+{
+    // Literals, numbers, operators and the core functions with arguments
+    // only. Anything that might refer to a node or a variable is not.
+    const xmlChar  *c = str;
+    const xmlChar  *name;
+    xrltBool        operand = FALSE;
+    int             len;
+    int             i;
+
+    while (*c != '\0') {
+        if (xmlIsBlank_ch(*c)) {
+            c++;
+        } else if (*c == '\'' || *c == '"') {
+            for (name = c++; *c != '\0' && *c != *name; c++);
+
+            if (*c == '\0') { return FALSE; }
+
+            c++;
+            operand = TRUE;
+        } else if ((*c >= '0' && *c <= '9') ||
+                   (*c == '.' && c[1] >= '0' && c[1] <= '9'))
+        {
+            while ((*c >= '0' && *c <= '9') || *c == '.') { c++; }
+
+            operand = TRUE;
+        } else if (*c == ')') {
+            c++;
+            operand = TRUE;
+        } else if (*c == '*') {
+            // Multiplication, not a name test.
+            if (!operand) { return FALSE; }
+
+            c++;
+            operand = FALSE;
+        } else if (*c == '(' || *c == ',' || *c == '=' || *c == '!' ||
+                   *c == '<' || *c == '>' || *c == '+' || *c == '-')
+        {
+            c++;
+            operand = FALSE;
+        } else if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') ||
+                   *c == '_')
+        {
+            for (name = c; xrltIsNameChar(*c) && *c != ':'; c++);
+
+            len = c - name;
+
+            while (xmlIsBlank_ch(*c)) { c++; }
+
+            if (*c != '(') {
+                // An operator name or a location step.
+                if (!operand || !xrltXPathIsOperatorName(name, len)) {
+                    return FALSE;
+                }
+
+                operand = FALSE;
+
+                continue;
+            }
+
+            for (i = 0; xrltXPathConstantFunctions[i] != NULL; i++) {
+                if (xmlStrlen(BAD_CAST xrltXPathConstantFunctions[i]) == len &&
+                    xmlStrncmp(name, BAD_CAST xrltXPathConstantFunctions[i],
+                               len) == 0)
+                {
+                    break;
+                }
+            }
+
+            if (xrltXPathConstantFunctions[i] == NULL) { return FALSE; }
+
+            // Without arguments, string(), number() and the like take the
+            // context node.
+            for (c++; xmlIsBlank_ch(*c); c++);
+
+            if (*c == ')' && xmlStrncmp(name, BAD_CAST "true", len) != 0 &&
+                xmlStrncmp(name, BAD_CAST "false", len) != 0)
+            {
+                return FALSE;
+            }
+
+            operand = FALSE;
+        } else {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+xrltBool
+xrltXPathCompileTest(xrltRequestsheetPtr sheet, const xmlChar *str,
+                     xrltCompiledValue *val)
+{
+    // Tests that depend on nothing are evaluated right away, so that the
+    // elements know their branches when the requestsheet is compiled.
+    xmlXPathContextPtr   xpath;
+    xmlXPathObjectPtr    v;
+
+    val->type = XRLT_VALUE_XPATH;
+
+    if (!xrltXPathCompile(sheet, str, &val->xpathval)) { return FALSE; }
+
+    if (val->xpathval.compiled->vars != NULL || !xrltXPathIsConstant(str)) {
+        return TRUE;
+    }
+
+    xpath = xmlXPathNewContext(NULL);
+
+    if (xpath == NULL) { return FALSE; }
+
+    v = xmlXPathCompiledEval(val->xpathval.expr, xpath);
+
+    xmlXPathFreeContext(xpath);
+
+    // Errors are left to the runtime to report.
+    if (v == NULL) { return TRUE; }
+
+    xrltXPathRelease(val->xpathval.compiled);
+    memset(&val->xpathval, 0, sizeof(xrltXPathExpr));
+
+    val->type = XRLT_VALUE_INT;
+    val->intval = xmlXPathCastToBoolean(v) ? 1 : 0;
+
+    xmlXPathFreeObject(v);
+
+    return TRUE;
+}
+
+
+void
+xrltXPathFreeCompiled(void *payload, const xmlChar *name)
+{
+    xrltXPathRelease((xrltXPathCompiled *)payload);
+}
+
+
+void
+xrltReferenceFree(void *data)
+{
+    // The node belongs to its own document, this one only marks the
+    // response placeholders.
+    (void)data;
+}
+
+
+static void
+xrltNodeToStringAdd(xmlBufferPtr buf, xmlNodePtr node)
+{
+    xrltNodeDataPtr   n = (xrltNodeDataPtr)node->_private;
+    xmlNodePtr        child;
+
+    if (n != NULL && n->free == xrltReferenceFree) {
+        xmlNodeBufGetContent(buf, (xmlNodePtr)n->data);
+
+        return;
+    }
+
+    for (child = node->children; child != NULL; child = child->next) {
+        switch (child->type) {
+            case XML_TEXT_NODE:
+            case XML_CDATA_SECTION_NODE:
+                xmlBufferCat(buf, child->content);
+
+                break;
+
+            case XML_ENTITY_REF_NODE:
+                xmlNodeBufGetContent(buf, child);
+
+                break;
+
+            case XML_ELEMENT_NODE:
+                xrltNodeToStringAdd(buf, child);
+
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+
+xmlChar *
+xrltNodeToString(xmlNodePtr node)
+{
+    // The same as xmlXPathCastNodeToString(), but the nodes referred to by
+    // the response placeholders (see xrltTransformByXPath()) are included.
+    xmlBufferPtr   buf;
+    xmlChar       *ret;
+
+    if (node->type != XML_ELEMENT_NODE) {
+        return xmlXPathCastNodeToString(node);
+    }
+
+    buf = xmlBufferCreate();
+
+    if (buf == NULL) { return NULL; }
+
+    xrltNodeToStringAdd(buf, node);
+
+    ret = xmlBufferDetach(buf);
+
+    xmlBufferFree(buf);
+
+    if (ret == NULL) { ret = xmlStrdup((const xmlChar *)""); }
+
+    return ret;
+}
+
+
 xrltBool
 xrltSetStringResult(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
                     void *data)
@@ -541,7 +1266,7 @@ xrltSetStringResult(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
             ctx, &n->tcb, xrltSetStringResult, comp, insert, data
         );
     } else {
-        *((xmlChar **)data) = xmlXPathCastNodeToString(node);
+        *((xmlChar **)data) = xrltNodeToString(node);
     }
 
     return TRUE;
@@ -596,7 +1321,7 @@ xrltSetBooleanResult(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
             ctx, &n->tcb, xrltSetBooleanResult, comp, insert, data
         );
     } else {
-        ret = xmlXPathCastNodeToString(node);
+        ret = xrltNodeToString(node);
         *((xrltBool *)data) = xmlXPathCastStringToBoolean(ret) ? TRUE : FALSE;
         xmlFree(ret);
     }
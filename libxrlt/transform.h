@@ -6,6 +6,7 @@
 #define __XRLT_TRANSFORM_H__
 
 
+#include <time.h>
 #include <libxml/tree.h>
 #include <libxml/hash.h>
 #include <libxml/xpath.h>
@@ -21,6 +22,13 @@ extern "C" {
 #endif
 
 
+#ifdef _MSC_VER
+    #define XRLT_THREAD_LOCAL   __declspec(thread)
+#else
+    #define XRLT_THREAD_LOCAL   __thread
+#endif
+
+
 #define XRLT_ELEMENT_ATTR_TEST      (const xmlChar *)"test"
 #define XRLT_ELEMENT_ATTR_NAME      (const xmlChar *)"name"
 #define XRLT_ELEMENT_ATTR_SELECT    (const xmlChar *)"select"
@@ -28,6 +36,13 @@ extern "C" {
 #define XRLT_ELEMENT_ATTR_ASYNC     (const xmlChar *)"async"
 #define XRLT_ELEMENT_ATTR_MAIN      (const xmlChar *)"main"
 #define XRLT_ELEMENT_ATTR_SRC       (const xmlChar *)"src"
+#define XRLT_ELEMENT_ATTR_MATCH     (const xmlChar *)"match"
+#define XRLT_ELEMENT_ATTR_USE       (const xmlChar *)"use"
+#define XRLT_ELEMENT_ATTR_OFFSET    (const xmlChar *)"offset"
+#define XRLT_ELEMENT_ATTR_LIMIT     (const xmlChar *)"limit"
+#define XRLT_ELEMENT_ATTR_ORDER     (const xmlChar *)"order"
+#define XRLT_ELEMENT_ATTR_DATA_TYPE (const xmlChar *)"data-type"
+#define XRLT_ELEMENT_ATTR_PURE      (const xmlChar *)"pure"
 #define XRLT_ELEMENT_PARAM          (const xmlChar *)"param"
 #define XRLT_ELEMENT_HREF           (const xmlChar *)"href"
 #define XRLT_ELEMENT_METHOD         (const xmlChar *)"method"
@@ -127,7 +142,8 @@ extern "C" {
     if (!xrltTransformCallbackQueuePush(tcb, func, comp, insert,              \
                                         ctx->varScope, ctx->xpathContext,     \
                                         ctx->xpathContextSize,                \
-                                        ctx->xpathProximityPosition, data))   \
+                                        ctx->xpathProximityPosition,          \
+                                        ctx->src, data))                      \
     {                                                                         \
         xrltTransformError(ctx, NULL, NULL, "Failed to push callback\n");     \
         return FALSE;                                                         \
@@ -135,6 +151,11 @@ extern "C" {
 }
 
 
+// Start time of a traced span, 0 when the context is not traced.
+#define TRACE_START(ctx)                                                      \
+    ((ctx)->trace != NULL ? xrltTimeNanoseconds() : 0)
+
+
 #define COUNTER_INCREASE(ctx, node) {                                         \
     if (!xrltNotReadyCounterIncrease(ctx, node)) { return FALSE; }            \
 }
@@ -301,21 +322,75 @@ struct _xrltNodeData {
     xrltTransformCallbackQueue   tcb;        // Callbacks to be called when
                                              // count == 0, only for response
                                              // doc nodes.
-    xmlDocPtr                    root;       // Root for XPath requests.
+    size_t                       id;         // Requestsheet node number to
+                                             // profile by, only for
+                                             // requestsheet nodes.
+    const xmlChar               *url;        // Requestsheet file of the
+                                             // nodes copied by xrl:import,
+                                             // from sheet->dict.
+    xmlDocPtr                    root;       // Root for XPath requests,
+                                             // inherited ones are cached
+                                             // by xrltXPathEval().
     void                        *sr;         // Subrequest data, to get headers
                                              // from.
     size_t                       parentScope;
     xrltBool                     hasVar;
+    void                        *release;    // Response level variables this
+                                             // requestsheet node is the last
+                                             // use of.
+    void                        *keys;       // Key indexes of a document
+                                             // node (see key.cc).
+    void                        *vars;       // Variable values with nodes of
+                                             // a variable document (see
+                                             // variable.cc).
 };
 
 
 void
         xrltUnregisterBuiltinElements   (void);
+xrltBool
+        xrltRegisterBuiltinElements     (void);
 xrltBool
         xrltHasXRLTElement              (xmlNodePtr node);
+xrltBool
+        xrltElementTransformInline      (xrltContextPtr ctx, xmlNodePtr first,
+                                         xmlNodePtr insert);
+xrltBool
+        xrltCanTransformInline          (xmlNodePtr first);
+xrltBool
+        xrltXPathCompile                (xrltRequestsheetPtr sheet,
+                                         const xmlChar *str,
+                                         xrltXPathExpr *expr);
+xrltBool
+        xrltXPathCompileTest            (xrltRequestsheetPtr sheet,
+                                         const xmlChar *str,
+                                         xrltCompiledValue *val);
+void
+        xrltXPathFreeCompiled           (void *payload, const xmlChar *name);
+xmlNodePtr
+        xrltXPathNotReady               (xrltContextPtr ctx,
+                                         xrltXPathExpr *expr);
+xrltBool
+        xrltXPathEvalFast               (xrltContextPtr ctx,
+                                         xrltXPathExpr *expr,
+                                         xmlXPathObjectPtr *ret);
 xmlXPathObjectPtr
         xrltVariableLookupFunc          (void *ctxt, const xmlChar *name,
                                          const xmlChar *ns_uri);
+void
+        xrltTraceSpan                   (xrltContextPtr ctx, const char *cat,
+                                         const xmlChar *name, size_t tid,
+                                         size_t started, const char *args);
+
+
+static inline xrltBool
+xrltIsNameChar(xmlChar c)
+{
+    // Everything non-ASCII counts as a name character.
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '.' || c == '-' || c == '_' ||
+           c == ':' || c >= 0x80;
+}
 
 
 static inline xrltBool
@@ -331,12 +406,51 @@ xrltIsXRLTNamespace(xmlNodePtr node)
 }
 
 
+static inline size_t
+xrltTimeNanoseconds(void)
+{
+    struct timespec   ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (size_t)ts.tv_sec * 1000000000 + (size_t)ts.tv_nsec;
+}
+
+
+static inline size_t
+xrltProfileStart(xrltContextPtr ctx)
+{
+    // The mark is the current time less the time profiled so far. Calls
+    // nested into this one add their time, which moves the mark forward
+    // and keeps it out of this call's time.
+    return xrltTimeNanoseconds() - ctx->profileSpent;
+}
+
+
+static inline void
+xrltProfileAdd(xrltContextPtr ctx, xmlNodePtr src, size_t mark)
+{
+    xrltNodeDataPtr     n = src == NULL ? NULL : (xrltNodeDataPtr)src->_private;
+    xrltProfileEntry   *e;
+    size_t              now = xrltTimeNanoseconds();
+
+    // Entry 0 is for the time spent outside of requestsheet elements.
+    e = &ctx->profile[n == NULL || n->id > ctx->sheet->nodeCount ? 0 : n->id];
+
+    e->calls++;
+    e->time += now - ctx->profileSpent - mark;
+
+    ctx->profileSpent = now - mark;
+}
+
+
 static inline xrltBool
 xrltTransformCallbackQueuePush(xrltTransformCallbackQueue *tcb,
                                xrltTransformFunction func, void *comp,
                                xmlNodePtr insert, size_t varScope,
                                xmlNodePtr xpathContext, int xpathContextSize,
-                               int xpathProximityPosition, void *data)
+                               int xpathProximityPosition, xmlNodePtr src,
+                               void *data)
 {
     if (tcb == NULL || func == NULL) {
         return FALSE;
@@ -354,6 +468,7 @@ xrltTransformCallbackQueuePush(xrltTransformCallbackQueue *tcb,
     item->xpathContext = xpathContext;
     item->xpathContextSize = xpathContextSize;
     item->xpathProximityPosition = xpathProximityPosition;
+    item->src = src;
     item->data = data;
 
 
@@ -374,7 +489,8 @@ xrltTransformCallbackQueueShift(xrltTransformCallbackQueue *tcb,
                                 xmlNodePtr *insert, size_t *varScope,
                                 xmlNodePtr *xpathContext,
                                 int *xpathContextSize,
-                                int *xpathProximityPosition, void **data)
+                                int *xpathProximityPosition, xmlNodePtr *src,
+                                void **data)
 {
     if (tcb == NULL) { return FALSE; }
 
@@ -392,6 +508,7 @@ xrltTransformCallbackQueueShift(xrltTransformCallbackQueue *tcb,
     *xpathContext = item->xpathContext;
     *xpathContextSize = item->xpathContextSize;
     *xpathProximityPosition = item->xpathProximityPosition;
+    *src = item->src;
 
     tcb->first = item->next;
     if (item->next == NULL) { tcb->last = NULL; }
@@ -412,12 +529,14 @@ xrltTransformCallbackQueueClear(xrltTransformCallbackQueue *tcb)
     xmlNodePtr              xpathContext;
     int                     xpathContextSize;
     int                     xpathProximityPosition;
+    xmlNodePtr              src;
     void                   *data;
 
     while (xrltTransformCallbackQueueShift(tcb, &func, &comp, &insert,
                                            &varScope, &xpathContext,
                                            &xpathContextSize,
-                                           &xpathProximityPosition, &data));
+                                           &xpathProximityPosition, &src,
+                                           &data));
 }
 
 
@@ -601,8 +720,7 @@ xrltCompileValue(xrltRequestsheetPtr sheet, xmlNodePtr node,
     memset(val, 0, sizeof(xrltCompiledValue));
 
     if (sel != NULL) {
-        val->xpathval.expr = xmlXPathCompile(sel);
-        if (val->xpathval.expr == NULL) {
+        if (!xrltXPathCompile(sheet, sel, &val->xpathval)) {
             xrltTransformError(NULL, sheet, node,
                                "Failed to compile '%s' expression\n",
                                xpathAttrName);
@@ -613,8 +731,7 @@ xrltCompileValue(xrltRequestsheetPtr sheet, xmlNodePtr node,
         val->xpathval.src = node;
         val->xpathval.scope = node->parent;
     } else if (vsel != NULL) {
-        val->xpathval.expr = xmlXPathCompile(vsel);
-        if (val->xpathval.expr == NULL) {
+        if (!xrltXPathCompile(sheet, vsel, &val->xpathval)) {
             xrltTransformError(NULL, sheet, vNode,
                                "Failed to compile '%s' expression\n",
                                XRLT_ELEMENT_ATTR_SELECT);
@@ -666,6 +783,10 @@ xrltCompileValue(xrltRequestsheetPtr sheet, xmlNodePtr node,
 }
 
 
+void
+    xrltReferenceFree             (void *data);
+xmlChar *
+    xrltNodeToString              (xmlNodePtr node);
 xrltBool
     xrltSetStringResult           (xrltContextPtr ctx, void *comp,
                                    xmlNodePtr insert, void *data);
@@ -767,6 +888,66 @@ xrltTransformToBoolean(xrltContextPtr ctx, xmlNodePtr insert,
 }
 
 
+static inline xrltBool
+xrltCanReference(xrltContextPtr ctx, xmlNodeSetPtr ns, xmlNodePtr insert)
+{
+    // The response is only turned into a string, so it can refer to the
+    // nodes instead of copying them, as long as their documents outlive the
+    // response chunks: variable documents are released after their last use
+    // is sent and the requestsheet is always there.
+    xmlNodePtr   node;
+    int          i;
+
+    if (insert->doc != ctx->responseDoc) { return FALSE; }
+
+    for (i = 0; i < ns->nodeNr; i++) {
+        node = ns->nodeTab[i];
+
+        if (node->type != XML_ELEMENT_NODE && node->type != XML_TEXT_NODE &&
+            node->type != XML_CDATA_SECTION_NODE)
+        {
+            return FALSE;
+        }
+
+        if (node->doc != ctx->sheet->doc &&
+            (node->doc == NULL || node->doc->parent != ctx->var))
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+static inline xrltBool
+xrltAddReference(xrltContextPtr ctx, xmlNodePtr src, xmlNodePtr insert,
+                 xmlNodePtr node)
+{
+    xmlNodePtr        ref;
+    xrltNodeDataPtr   n;
+
+    ref = xmlNewChild(insert, NULL, (const xmlChar *)"ref", NULL);
+
+    if (ref == NULL) {
+        ERROR_CREATE_NODE(ctx, NULL, src);
+        return FALSE;
+    }
+
+    n = (xrltNodeDataPtr)ref->_private;
+
+    if (n == NULL) {
+        xrltTransformError(ctx, NULL, src, "Element has no data\n");
+        return FALSE;
+    }
+
+    n->data = node;
+    n->free = xrltReferenceFree;
+
+    return TRUE;
+}
+
+
 static inline xrltBool
 xrltTransformByXPath(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
                      void *data)
@@ -825,6 +1006,19 @@ xrltTransformByXPath(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
                         }
                     }
 
+                    if (xrltCanReference(ctx, ns, insert)) {
+                        for (i = 0; i < ns->nodeNr; i++) {
+                            if (!xrltAddReference(ctx, expr->src, insert,
+                                                  ns->nodeTab[i]))
+                            {
+                                ret = FALSE;
+                                goto error;
+                            }
+                        }
+
+                        break;
+                    }
+
                     for (i = 0; i < ns->nodeNr; i++) {
                         node = xmlDocCopyNode(ns->nodeTab[i], insert->doc, 1);
 
@@ -950,6 +1144,22 @@ xrltTransformByCompiledValue(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
 }
 
 
+static inline xmlDocPtr
+xrltDocCreate(xrltContextPtr ctx)
+{
+    // Documents of a context share the dictionary, so that moving and
+    // copying nodes between them doesn't copy the names.
+    xmlDocPtr   doc = xmlNewDoc(NULL);
+
+    if (doc != NULL && ctx->dict != NULL) {
+        doc->dict = ctx->dict;
+        xmlDictReference(doc->dict);
+    }
+
+    return doc;
+}
+
+
 static inline xrltBool
 xrltCopyXPathRoot(xmlNodePtr src, xmlDocPtr dst)
 {
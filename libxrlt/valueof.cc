@@ -31,9 +31,7 @@ xrltValueOfCompile(xrltRequestsheetPtr sheet, xmlNodePtr node, void *prevcomp)
     ret->select.type = XRLT_VALUE_XPATH;
     ret->select.xpathval.src = node;
     ret->select.xpathval.scope = node->parent;
-    ret->select.xpathval.expr = xmlXPathCompile(select);
-
-    if (ret->select.xpathval.expr == NULL) {
+    if (!xrltXPathCompile(sheet, select, &ret->select.xpathval)) {
         xrltTransformError(NULL, sheet, node,
                            "Failed to compile expression\n");
         goto error;
@@ -88,8 +86,31 @@ xrltValueOfTransform(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
     xrltValueOfData              *vcomp = (xrltValueOfData *)comp;
     xrltNodeDataPtr               n;
     xrltValueOfTransformingData  *tdata;
+    xmlXPathObjectPtr             v;
+    xmlChar                      *s;
 
     if (data == NULL) {
+        // Values that are ready right away go straight to the output, the
+        // others are waited for in a wrapper node.
+        if (!xrltXPathEval(ctx, insert, &vcomp->select.xpathval, &v)) {
+            return FALSE;
+        }
+
+        if (v != NULL) {
+            s = xmlXPathCastToString(v);
+
+            xmlXPathFreeObject(v);
+
+            if (s == NULL) {
+                ERROR_OUT_OF_MEMORY(ctx, NULL, vcomp->node);
+                return FALSE;
+            }
+
+            NEW_TEXT_CHILD(ctx, node, insert, s, xmlStrlen(s), xmlFree(s));
+
+            return TRUE;
+        }
+
         NEW_CHILD(ctx, node, insert, "v-o");
 
         ASSERT_NODE_DATA(node, n);
@@ -98,6 +98,13 @@ xrltVariableFree(void *comp)
 }
 
 
+static void
+xrltVariableFreeValue(void *payload, const xmlChar *name)
+{
+    xmlXPathFreeObject((xmlXPathObjectPtr)payload);
+}
+
+
 static xrltBool
 xrltVariableFromXPath(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
                       void *data)
@@ -119,14 +126,14 @@ xrltVariableFromXPath(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
         if (n->data != NULL) {
             sc = ((size_t)n->data) - 1;
         } else {
-            sc = vcomp->declScopePos > 0 ? vcomp->declScopePos : ctx->varScope;
+            sc = vcomp->applyParam ? ctx->applyScope : ctx->varScope;
         }
 
         XRLT_SET_VARIABLE_ID(id, vcomp->declScope, sc);
 
         if (n->data != NULL) {
             xmlHashRemoveEntry2(ctx->xpath->varHash, id, vcomp->name,
-                                (xmlHashDeallocator)xmlXPathFreeObject);
+                                xrltVariableFreeValue);
 
             COUNTER_DECREASE(ctx, (xmlNodePtr)vdoc);
         }
@@ -140,7 +147,7 @@ xrltVariableFromXPath(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
         );
     } else {
         if (n->data == NULL) {
-            sc = vcomp->declScopePos > 0 ? vcomp->declScopePos : ctx->varScope;
+            sc = vcomp->applyParam ? ctx->applyScope : ctx->varScope;
 
             XRLT_SET_VARIABLE(
                 id, vcomp->node, vcomp->name, vcomp->declScope, sc, vdoc, val
@@ -172,7 +179,7 @@ xrltVariableTransform(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
     xmlChar             id[sizeof(xmlNodePtr) * 7];
     size_t              sc;
 
-    sc = vcomp->declScopePos > 0 ? vcomp->declScopePos : ctx->varScope;
+    sc = vcomp->applyParam ? ctx->applyScope : ctx->varScope;
 
     if (data == NULL) {
         if (vcomp->isParam && ctx->params != NULL) {
@@ -191,7 +198,7 @@ xrltVariableTransform(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
 
         switch (vcomp->val.type) {
             case XRLT_VALUE_NODELIST:
-                vdoc = xmlNewDoc(NULL);
+                vdoc = xrltDocCreate(ctx);
                 xmlAddChild(ctx->var, (xmlNodePtr)vdoc);
                 vdoc->doc = vdoc;
 
@@ -213,7 +220,7 @@ xrltVariableTransform(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
                 break;
 
             case XRLT_VALUE_XPATH:
-                vdoc = xmlNewDoc(NULL);
+                vdoc = xrltDocCreate(ctx);
                 xmlAddChild(ctx->var, (xmlNodePtr)vdoc);
                 vdoc->doc = vdoc;
 
@@ -247,3 +254,334 @@ xrltVariableTransform(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
 
     return TRUE;
 }
+
+
+static inline xrltVariableDataPtr
+xrltVariableOf(xmlNodePtr node)
+{
+    xrltNodeDataPtr   n = (xrltNodeDataPtr)node->_private;
+
+    return n != NULL && n->xrlt && n->transform == xrltVariableTransform
+        ?
+        (xrltVariableDataPtr)n->data
+        :
+        NULL;
+}
+
+
+static xrltBool
+xrltVariableIsReferenced(const xmlChar *str, const xmlChar *name, int len)
+{
+    const xmlChar  *c;
+
+    if (str == NULL) { return FALSE; }
+
+    for (c = xmlStrchr(str, '$'); c != NULL; c = xmlStrchr(c + 1, '$')) {
+        if (xmlStrncmp(c + 1, name, len) == 0 &&
+            !xrltIsNameChar(c[len + 1]))
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+static xrltBool
+xrltVariableIsUsed(xmlNodePtr node, const xmlChar *name, int len)
+{
+    // Looks for $name in every attribute and every text of the subtree, it
+    // might find more uses than there are, but never less.
+    xmlAttrPtr   attr;
+    xmlNodePtr   child;
+
+    if (node->type == XML_TEXT_NODE || node->type == XML_CDATA_SECTION_NODE) {
+        return xrltVariableIsReferenced(node->content, name, len);
+    }
+
+    if (node->type != XML_ELEMENT_NODE) { return FALSE; }
+
+    for (attr = node->properties; attr != NULL; attr = attr->next) {
+        for (child = attr->children; child != NULL; child = child->next) {
+            if (xrltVariableIsReferenced(child->content, name, len)) {
+                return TRUE;
+            }
+        }
+    }
+
+    for (child = node->children; child != NULL; child = child->next) {
+        if (xrltVariableIsUsed(child, name, len)) { return TRUE; }
+    }
+
+    return FALSE;
+}
+
+
+void
+xrltVariableSetLastUse(xmlNodePtr response)
+{
+    xmlNodePtr            node;
+    xmlNodePtr            use;
+    xmlNodePtr            last;
+    xrltVariableDataPtr   vcomp;
+    xrltVariableDataPtr   prev;
+    xrltNodeDataPtr       n;
+
+    if (response == NULL) { return; }
+
+    for (node = response->children; node != NULL; node = node->next) {
+        vcomp = xrltVariableOf(node);
+
+        if (vcomp == NULL) { continue; }
+
+        vcomp->lastUse = node;
+
+        for (use = node->next; use != NULL; use = use->next) {
+            if (xrltVariableIsUsed(use, vcomp->name, xmlStrlen(vcomp->name))) {
+                vcomp->lastUse = use;
+            }
+        }
+    }
+
+    // A variable might keep nodes of the variables it is declared with, so
+    // those live as long as it does. Going backwards resolves the chains.
+    for (node = response->last; node != NULL; node = node->prev) {
+        vcomp = xrltVariableOf(node);
+
+        if (vcomp == NULL) { continue; }
+
+        for (use = node->prev; use != NULL; use = use->prev) {
+            prev = xrltVariableOf(use);
+
+            if (prev == NULL ||
+                !xrltVariableIsUsed(node, prev->name, xmlStrlen(prev->name)))
+            {
+                continue;
+            }
+
+            for (last = prev->lastUse;
+                 last != NULL && last != vcomp->lastUse;
+                 last = last->next);
+
+            if (last != NULL) {
+                prev->lastUse = last;
+            }
+        }
+    }
+
+    // Variables are released in reverse order, so that nothing refers to
+    // the documents being freed.
+    for (node = response->children; node != NULL; node = node->next) {
+        vcomp = xrltVariableOf(node);
+
+        if (vcomp == NULL) { continue; }
+
+        n = (xrltNodeDataPtr)vcomp->lastUse->_private;
+
+        vcomp->nextRelease = (xrltVariableDataPtr)n->release;
+        n->release = vcomp;
+    }
+}
+
+
+void
+xrltVariableReleaseFree(void *data)
+{
+    if (data != NULL) { xmlFree(data); }
+}
+
+
+xrltBool
+xrltVariableReleaseMark(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
+                        void *data)
+{
+    xmlNodePtr                 node;
+    xrltNodeDataPtr            n;
+    xrltVariableReleaseData   *rdata;
+
+    // This one is called right after the last use of the variables, so the
+    // marker goes after everything that might refer to them. The response
+    // releases the variables when it gets to the marker.
+    NEW_CHILD(ctx, node, insert, "release");
+
+    ASSERT_NODE_DATA(node, n);
+
+    XRLT_MALLOC(ctx, NULL, NULL, rdata, xrltVariableReleaseData*,
+                sizeof(xrltVariableReleaseData), FALSE);
+
+    rdata->first = (xrltVariableDataPtr)comp;
+    rdata->scope = ctx->varScope;
+
+    n->data = rdata;
+    n->free = xrltVariableReleaseFree;
+
+    return TRUE;
+}
+
+
+typedef struct _xrltVariableRef xrltVariableRef;
+struct _xrltVariableRef {
+    xmlChar             *id;
+    const xmlChar       *name;
+    xmlXPathObjectPtr    val;
+    xrltVariableRef     *next;
+};
+
+
+xrltBool
+xrltVariableRemember(xrltContextPtr ctx, const xmlChar *id,
+                     const xmlChar *name, xmlXPathObjectPtr val)
+{
+    // Links the value to every variable document it has the nodes of, so
+    // that releasing a document finds the values to forget right away.
+    xmlNodePtr        node;
+    xmlNodePtr        doc;
+    xmlNodePtr        prev = NULL;
+    xrltNodeDataPtr   n;
+    xrltVariableRef  *ref;
+    int               i;
+
+    if (val->type != XPATH_NODESET || val->nodesetval == NULL) {
+        return TRUE;
+    }
+
+    for (i = 0; i < val->nodesetval->nodeNr; i++) {
+        node = val->nodesetval->nodeTab[i];
+
+        // Namespace nodes are copies owned by the value.
+        if (node->type == XML_NAMESPACE_DECL) { continue; }
+
+        doc = (xmlNodePtr)node->doc;
+
+        if (doc == NULL || doc == prev || doc->parent != ctx->var) {
+            continue;
+        }
+
+        prev = doc;
+
+        ASSERT_NODE_DATA(doc, n);
+
+        if (n->vars != NULL && ((xrltVariableRef *)n->vars)->val == val) {
+            continue;
+        }
+
+        XRLT_MALLOC(ctx, NULL, NULL, ref, xrltVariableRef *,
+                    sizeof(xrltVariableRef), FALSE);
+
+        ref->id = xmlStrdup(id);
+
+        if (ref->id == NULL) {
+            xmlFree(ref);
+            ERROR_OUT_OF_MEMORY(ctx, NULL, NULL);
+            return FALSE;
+        }
+
+        ref->name = name;
+        ref->val = val;
+        ref->next = (xrltVariableRef *)n->vars;
+
+        n->vars = ref;
+    }
+
+    return TRUE;
+}
+
+
+void
+xrltVariableRefsFree(void *refs)
+{
+    xrltVariableRef  *ref = (xrltVariableRef *)refs;
+    xrltVariableRef  *next;
+
+    while (ref != NULL) {
+        next = ref->next;
+
+        xmlFree(ref->id);
+        xmlFree(ref);
+
+        ref = next;
+    }
+}
+
+
+static void
+xrltVariableForget(xrltContextPtr ctx, xmlDocPtr doc)
+{
+    // Removes every variable value with the nodes of the document, nobody
+    // is going to look them up, but freeing them would touch the nodes.
+    xrltNodeDataPtr   n = (xrltNodeDataPtr)doc->_private;
+    xrltVariableRef  *ref;
+
+    if (n == NULL) { return; }
+
+    for (ref = (xrltVariableRef *)n->vars; ref != NULL; ref = ref->next) {
+        // The value might be removed already along with some other
+        // document, its pointer is only compared.
+        if (xmlHashLookup2(ctx->xpath->varHash, ref->id, ref->name) ==
+            ref->val)
+        {
+            xmlHashRemoveEntry2(ctx->xpath->varHash, ref->id, ref->name,
+                                xrltVariableFreeValue);
+        }
+    }
+}
+
+
+xrltBool
+xrltVariableRelease(xrltContextPtr ctx, void *comp, xmlNodePtr insert,
+                    void *data)
+{
+    xrltVariableDataPtr   vcomp = (xrltVariableDataPtr)comp;
+    size_t                sc = (size_t)data - 1;
+    xmlChar               id[sizeof(xmlNodePtr) * 7];
+    xmlXPathObjectPtr     val;
+    xmlNodePtr            vdoc;
+    xrltNodeDataPtr       n;
+
+    for (; vcomp != NULL; vcomp = vcomp->nextRelease) {
+        XRLT_SET_VARIABLE_ID(id, vcomp->declScope, sc);
+
+        val = (xmlXPathObjectPtr)xmlHashLookup2(ctx->xpath->varHash, id,
+                                                vcomp->name);
+
+        if (val == NULL) { continue; }
+
+        vdoc = NULL;
+
+        if (val->type == XPATH_NODESET && val->nodesetval != NULL &&
+            val->nodesetval->nodeNr == 1)
+        {
+            vdoc = val->nodesetval->nodeTab[0];
+
+            if (vdoc->type != XML_DOCUMENT_NODE || vdoc->parent != ctx->var) {
+                vdoc = NULL;
+            }
+        }
+
+        if (vdoc != NULL) {
+            ASSERT_NODE_DATA(vdoc, n);
+
+            if (n->count > 0) {
+                // The variable is not ready yet.
+                SCHEDULE_CALLBACK(ctx, &n->tcb, xrltVariableRelease, vcomp,
+                                  insert, data);
+                return TRUE;
+            }
+        }
+
+        if (vdoc == NULL || vcomp->val.type != XRLT_VALUE_NODELIST) {
+            // The value belongs to some other document.
+            xmlHashRemoveEntry2(ctx->xpath->varHash, id, vcomp->name,
+                                xrltVariableFreeValue);
+            continue;
+        }
+
+        xrltVariableForget(ctx, (xmlDocPtr)vdoc);
+
+        xmlUnlinkNode(vdoc);
+        xmlFreeDoc((xmlDocPtr)vdoc);
+    }
+
+    return TRUE;
+}
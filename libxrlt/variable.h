@@ -47,6 +47,9 @@ extern "C" {
                            "Redefinition of variable '%s'\n", _name);         \
         return FALSE;                                                         \
     }                                                                         \
+    if (!xrltVariableRemember(ctx, _id, _name, _val)) {                       \
+        return FALSE;                                                         \
+    }                                                                         \
 }
 
 
@@ -55,7 +58,8 @@ typedef xrltVariableData* xrltVariableDataPtr;
 struct _xrltVariableData {
     xmlNodePtr          node;
     xmlNodePtr          declScope;
-    size_t              declScopePos;
+    xrltBool            applyParam;  // Parameter of xrl:apply, it is declared
+                                     // in ctx->applyScope.
 
     xrltBool            isParam;
 
@@ -69,6 +73,11 @@ struct _xrltVariableData {
 
     xrltBool            ownVal;
     xrltCompiledValue   val;
+
+    xmlNodePtr          lastUse;      // Last xrl:response child using the
+                                      // variable (response level variables
+                                      // only).
+    xrltVariableData   *nextRelease;  // Next variable with the same last use.
 };
 
 
@@ -77,6 +86,12 @@ typedef struct {
 } xrltVariableTransformingData;
 
 
+typedef struct {
+    xrltVariableData           *first;
+    size_t                      scope;
+} xrltVariableReleaseData;
+
+
 void *
         xrltVariableCompile     (xrltRequestsheetPtr sheet, xmlNodePtr node,
                                  void *prevcomp);
@@ -86,6 +101,23 @@ xrltBool
         xrltVariableTransform   (xrltContextPtr ctx, void *comp,
                                  xmlNodePtr insert, void *data);
 
+void
+        xrltVariableSetLastUse  (xmlNodePtr response);
+void
+        xrltVariableReleaseFree (void *data);
+xrltBool
+        xrltVariableReleaseMark (xrltContextPtr ctx, void *comp,
+                                 xmlNodePtr insert, void *data);
+xrltBool
+        xrltVariableRelease     (xrltContextPtr ctx, void *comp,
+                                 xmlNodePtr insert, void *data);
+
+xrltBool
+        xrltVariableRemember    (xrltContextPtr ctx, const xmlChar *id,
+                                 const xmlChar *name, xmlXPathObjectPtr val);
+void
+        xrltVariableRefsFree    (void *refs);
+
 
 #ifdef __cplusplus
 }
@@ -1,5 +1,6 @@
 #include "transform.h"
 #include "include.h"
+#include "key.h"
 #include "xpathfuncs.h"
 
 
@@ -48,6 +49,102 @@ xrltStatusFunction(xmlXPathParserContextPtr ctxt, int nargs)
 }
 
 
+static void
+xrltKeyFunction(xmlXPathParserContextPtr ctxt, int nargs)
+{
+    // key(name, value[, node-set]) looks in the document of the context
+    // node or of the first node of the third argument, the latter is how
+    // one document is joined with another.
+    xrltContextPtr       xctx;
+    xmlXPathObjectPtr    top = NULL;
+    xmlXPathObjectPtr    value;
+    xmlChar             *name;
+    xmlChar             *s;
+    xmlNodePtr           node;
+    xmlNodeSetPtr        ret;
+    xmlNodeSetPtr        set;
+    xrltBool             ok = TRUE;
+    int                  i;
+
+    if (nargs != 2 && nargs != 3) {
+        XP_ERROR(XPATH_INVALID_ARITY);
+    }
+
+    xctx = xrltXPathGetTransformContext(ctxt);
+
+    if (xctx == NULL) {
+        XP_ERROR(XPATH_INVALID_CTXT);
+    }
+
+    if (nargs == 3) {
+        top = valuePop(ctxt);
+
+        if (top == NULL || top->type != XPATH_NODESET) {
+            xmlXPathFreeObject(top);
+            XP_ERROR(XPATH_INVALID_TYPE);
+        }
+
+        node = xmlXPathNodeSetItem(top->nodesetval, 0);
+    } else {
+        node = ctxt->context->node;
+    }
+
+    value = valuePop(ctxt);
+    name = xmlXPathPopString(ctxt);
+
+    ret = xmlXPathNodeSetCreate(NULL);
+
+    // Documents still being built (the response) are never indexed.
+    if (node != NULL && node->doc != NULL && node->doc != xctx->responseDoc &&
+        value != NULL && name != NULL && ret != NULL)
+    {
+        if (value->type == XPATH_NODESET) {
+            for (i = 0; value->nodesetval != NULL &&
+                        i < value->nodesetval->nodeNr && ok; i++)
+            {
+                s = xmlXPathCastNodeToString(value->nodesetval->nodeTab[i]);
+
+                ok = s != NULL &&
+                     xrltKeyLookup(xctx, name, node->doc, s, &set);
+
+                if (ok && set != NULL) {
+                    ret = xmlXPathNodeSetMerge(ret, set);
+                }
+
+                if (s != NULL) { xmlFree(s); }
+            }
+
+            if (ret != NULL && value->nodesetval != NULL &&
+                value->nodesetval->nodeNr > 1)
+            {
+                xmlXPathNodeSetSort(ret);
+            }
+        } else {
+            s = xmlXPathCastToString(value);
+
+            ok = s != NULL && xrltKeyLookup(xctx, name, node->doc, s, &set);
+
+            if (ok && set != NULL) {
+                ret = xmlXPathNodeSetMerge(ret, set);
+            }
+
+            if (s != NULL) { xmlFree(s); }
+        }
+    }
+
+    if (top != NULL) { xmlXPathFreeObject(top); }
+    if (value != NULL) { xmlXPathFreeObject(value); }
+    if (name != NULL) { xmlFree(name); }
+
+    if (!ok || ret == NULL) {
+        if (ret != NULL) { xmlXPathFreeNodeSet(ret); }
+        XP_ERROR(XPATH_EXPR_ERROR);
+    }
+
+    valuePush(ctxt, xmlXPathWrapNodeSet(ret));
+}
+
+
 xrltBool
 xrltRegisterFunctions(xmlXPathContextPtr ctxt)
 {
@@ -57,5 +154,11 @@ xrltRegisterFunctions(xmlXPathContextPtr ctxt)
         return FALSE;
     }
 
+    if (xmlXPathRegisterFunc(ctxt, (const xmlChar *)"key",
+                             xrltKeyFunction) != 0)
+    {
+        return FALSE;
+    }
+
     return TRUE;
 }
@@ -10,12 +10,204 @@
 #include "transform.h"
 #include "include.h"
 #include "import.h"
+#include "response.h"
+#include "variable.h"
+#include "key.h"
 #include "xpathfuncs.h"
 
 #ifndef __XRLT_NO_JAVASCRIPT__
     #include "js.h"
 #endif
 
+#if defined(_MSC_VER)
+    #include <malloc.h>
+    #define XRLT_MEM_SIZE(mem)  _msize(mem)
+#elif defined(__APPLE__)
+    #include <malloc/malloc.h>
+    #define XRLT_MEM_SIZE(mem)  malloc_size(mem)
+#else
+    #include <malloc.h>
+    #define XRLT_MEM_SIZE(mem)  malloc_usable_size(mem)
+#endif
+
+
+static xrltBool                         xrltMemStatsEnabled = FALSE;
+static xmlFreeFunc                      xrltMemFreeOrig;
+static xmlMallocFunc                    xrltMemMallocOrig;
+static xmlMallocFunc                    xrltMemMallocAtomicOrig;
+static xmlReallocFunc                   xrltMemReallocOrig;
+static xmlStrdupFunc                    xrltMemStrdupOrig;
+// Counters the allocations of this thread go to, it's the context or the
+// requestsheet being processed by the thread at the moment.
+static XRLT_THREAD_LOCAL xrltMemStats  *xrltMemStatsCurrent = NULL;
+// Live bytes are counted only when libxml2 allocates with the system
+// allocator, which can tell the size of a block being freed.
+static xrltBool                         xrltMemLive = FALSE;
+
+
+static inline size_t
+xrltMemSize(void *mem)
+{
+    // Size of the block the system allocator has given out, it is what is
+    // counted as live memory.
+    if (!xrltMemLive || mem == NULL) { return 0; }
+
+    return XRLT_MEM_SIZE(mem);
+}
+
+
+static inline void
+xrltMemLiveAdd(xrltMemStats *stats, size_t size)
+{
+    stats->live += size;
+
+    if (stats->live > stats->peak) {
+        stats->peak = stats->live;
+    }
+}
+
+
+static inline void
+xrltMemLiveSub(xrltMemStats *stats, size_t size)
+{
+    // Memory allocated while counting for somebody else might be freed
+    // here, don't go below zero.
+    stats->live = stats->live > size ? stats->live - size : 0;
+}
+
+
+static void
+xrltMemFree(void *mem)
+{
+    xrltMemStats  *stats = xrltMemStatsCurrent;
+
+    if (stats != NULL && mem != NULL) {
+        stats->frees++;
+        xrltMemLiveSub(stats, xrltMemSize(mem));
+    }
+
+    xrltMemFreeOrig(mem);
+}
+
+
+static void *
+xrltMemMalloc(size_t size)
+{
+    xrltMemStats  *stats = xrltMemStatsCurrent;
+    void          *ret = xrltMemMallocOrig(size);
+
+    if (stats != NULL) {
+        stats->allocs++;
+        stats->bytes += size;
+        xrltMemLiveAdd(stats, xrltMemSize(ret));
+    }
+
+    return ret;
+}
+
+
+static void *
+xrltMemMallocAtomic(size_t size)
+{
+    xrltMemStats  *stats = xrltMemStatsCurrent;
+    void          *ret = xrltMemMallocAtomicOrig(size);
+
+    if (stats != NULL) {
+        stats->allocs++;
+        stats->bytes += size;
+        xrltMemLiveAdd(stats, xrltMemSize(ret));
+    }
+
+    return ret;
+}
+
+
+static void *
+xrltMemRealloc(void *mem, size_t size)
+{
+    xrltMemStats  *stats = xrltMemStatsCurrent;
+    size_t         prev = stats == NULL ? 0 : xrltMemSize(mem);
+    void          *ret = xrltMemReallocOrig(mem, size);
+
+    if (stats != NULL) {
+        stats->reallocs++;
+        stats->bytes += size;
+
+        if (ret != NULL) {
+            xrltMemLiveSub(stats, prev);
+            xrltMemLiveAdd(stats, xrltMemSize(ret));
+        }
+    }
+
+    return ret;
+}
+
+
+static char *
+xrltMemStrdup(const char *str)
+{
+    xrltMemStats  *stats = xrltMemStatsCurrent;
+    size_t         allocs = stats == NULL ? 0 : stats->allocs;
+    char          *ret = xrltMemStrdupOrig(str);
+
+    // Default xmlStrdup() allocates with xmlMallocAtomic(), which has
+    // counted it already.
+    if (stats != NULL && stats->allocs == allocs) {
+        stats->allocs++;
+        stats->bytes += strlen(str) + 1;
+        xrltMemLiveAdd(stats, xrltMemSize(ret));
+    }
+
+    return ret;
+}
+
+
+static inline xrltMemStats *
+xrltMemStatsSwitch(xrltMemStats *stats)
+{
+    xrltMemStats  *prev;
+
+    if (!xrltMemStatsEnabled) { return NULL; }
+
+    prev = xrltMemStatsCurrent;
+    xrltMemStatsCurrent = stats;
+
+    return prev;
+}
+
+
+static inline void
+xrltMemStatsAdd(xrltMemStats *to, xrltMemStats *stats)
+{
+    size_t   peak;
+
+    // Contexts of one requestsheet might be freed by different threads.
+    __sync_fetch_and_add(&to->allocs, stats->allocs);
+    __sync_fetch_and_add(&to->reallocs, stats->reallocs);
+    __sync_fetch_and_add(&to->frees, stats->frees);
+    __sync_fetch_and_add(&to->bytes, stats->bytes);
+    __sync_fetch_and_add(&to->live, stats->live);
+
+    do {
+        peak = to->peak;
+
+        if (peak >= stats->peak) { break; }
+    } while (!__sync_bool_compare_and_swap(&to->peak, peak, stats->peak));
+}
+
+
+static inline void
+xrltMemStatsInit(xrltMemStats *stats, void *owner, size_t size)
+{
+    // The counters live in the structure they count for, so its own
+    // allocation is made before there is anywhere to count it to.
+    if (!xrltMemStatsEnabled) { return; }
+
+    stats->allocs = 1;
+    stats->bytes = size;
+    xrltMemLiveAdd(stats, xrltMemSize(owner));
+}
+
 
 static xrltBool
 xrltRemoveBlankNodesAndComments(xrltRequestsheetPtr sheet, xmlNodePtr first,
@@ -122,21 +314,62 @@ xrltDeregisterNodeFunc(xmlNodePtr node)
             xrltTransformCallbackQueueClear(&data->tcb);
         }
 
+        if (data->keys != NULL) {
+            xrltKeyIndexFree(data->keys);
+        }
+
+        if (data->vars != NULL) {
+            xrltVariableRefsFree(data->vars);
+        }
+
         xmlFree(data);
     }
 }
 
 
-xrltRequestsheetPtr
-xrltRequestsheetCreate(xmlDocPtr doc)
+static const char *xrltDictNames[] = {
+    "response", "var", "req", "h", "c", "t", "r", "v-o", "tmp", "release",
+    "log", "a", "d", "i", "n", "p", "s", "ref", NULL
+};
+
+
+static xrltBool
+xrltRequestsheetDictInit(xrltRequestsheetPtr sheet, xmlDocPtr doc)
 {
-    if (doc == NULL) { return NULL; }
+    // The requestsheet element names get copied to the response, the rest
+    // of the response is built of a few fixed names. Both are interned once
+    // here, contexts only look them up.
+    int   i;
+
+    if (doc->dict != NULL) {
+        sheet->dict = doc->dict;
+        xmlDictReference(sheet->dict);
+    } else {
+        sheet->dict = xmlDictCreate();
 
-    xrltRequestsheetPtr       ret;
-    xmlNodePtr                root;
+        if (sheet->dict == NULL) {
+            ERROR_OUT_OF_MEMORY(NULL, sheet, NULL);
+            return FALSE;
+        }
+    }
 
-    XRLT_MALLOC(NULL, NULL, NULL, ret, xrltRequestsheetPtr,
-                sizeof(xrltRequestsheet), NULL);
+    for (i = 0; xrltDictNames[i] != NULL; i++) {
+        if (xmlDictLookup(sheet->dict, (const xmlChar *)xrltDictNames[i],
+                          -1) == NULL)
+        {
+            ERROR_OUT_OF_MEMORY(NULL, sheet, NULL);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+static xrltBool
+xrltRequestsheetCompile(xrltRequestsheetPtr ret, xmlDocPtr doc)
+{
+    xmlNodePtr   root;
 
     root = xmlDocGetRootElement(doc);
 
@@ -147,39 +380,69 @@ xrltRequestsheetCreate(xmlDocPtr doc)
     {
         ERROR_UNEXPECTED_ELEMENT(NULL, NULL, root);
 
-        goto error;
+        return FALSE;
+    }
+
+    // Imports keep the names of their files in the dictionary.
+    if (!xrltRequestsheetDictInit(ret, doc)) {
+        return FALSE;
     }
 
     if (!xrltProcessImports(ret, root, 1)) {
-        goto error;
+        return FALSE;
     }
 
     xmlReconciliateNs(doc, root);
 
     if (!xrltRemoveBlankNodesAndComments(ret, root, FALSE)) {
-        goto error;
+        return FALSE;
     }
 
     ret->pass = XRLT_PASS1;
     if (!xrltElementCompile(ret, root->children)) {
-        goto error;
+        return FALSE;
     }
 
     ret->pass = XRLT_PASS2;
     if (!xrltElementCompile(ret, root->children)) {
-        goto error;
+        return FALSE;
     }
 
     ret->pass = XRLT_COMPILED;
 
+    xrltVariableSetLastUse(ret->response);
+
     ret->doc = doc;
 
-    return ret;
+    return TRUE;
+}
 
-  error:
-    xrltRequestsheetFree(ret);
 
-    return NULL;
+xrltRequestsheetPtr
+xrltRequestsheetCreate(xmlDocPtr doc)
+{
+    if (doc == NULL) { return NULL; }
+
+    xrltRequestsheetPtr   ret;
+    xrltMemStats         *prev;
+    xrltBool              compiled;
+
+    XRLT_MALLOC(NULL, NULL, NULL, ret, xrltRequestsheetPtr,
+                sizeof(xrltRequestsheet), NULL);
+
+    xrltMemStatsInit(&ret->mem, ret, sizeof(xrltRequestsheet));
+
+    prev = xrltMemStatsSwitch(&ret->mem);
+    compiled = xrltRequestsheetCompile(ret, doc);
+    xrltMemStatsSwitch(prev);
+
+    if (!compiled) {
+        xrltRequestsheetFree(ret);
+
+        return NULL;
+    }
+
+    return ret;
 }
 
 
@@ -196,13 +459,25 @@ xrltRequestsheetFree(xrltRequestsheetPtr sheet)
         xmlHashFree(sheet->transforms, NULL);
     }
 
+    if (sheet->xpath != NULL) {
+        xmlHashFree(sheet->xpath, xrltXPathFreeCompiled);
+    }
+
+    if (sheet->keys != NULL) {
+        xmlHashFree(sheet->keys, NULL);
+    }
+
     if (sheet->doc != NULL) {
         xmlFreeDoc(sheet->doc);
     }
 
+    if (sheet->dict != NULL) {
+        xmlDictFree(sheet->dict);
+    }
+
 #ifndef __XRLT_NO_JAVASCRIPT__
     if (sheet->js != NULL) {
-        xrltJSContextFree((xrltJSContextPtr)sheet->js);
+        xrltJSSheetFree((xrltJSSheetPtr)sheet->js);
     }
 #endif
 
@@ -210,22 +485,27 @@ xrltRequestsheetFree(xrltRequestsheetPtr sheet)
 }
 
 
-xrltContextPtr
-xrltContextCreate(xrltRequestsheetPtr sheet, xmlChar **params)
+static xrltBool
+xrltContextInit(xrltContextPtr ret, xrltRequestsheetPtr sheet,
+                xmlChar **params)
 {
-    xrltContextPtr                ret;
     xmlNodePtr                    response;
     xrltIncludeTransformingData  *data;
     xrltNodeDataPtr               n;
 
-    if (sheet == NULL) { return NULL; }
+    ret->sheet = sheet;
 
-    XRLT_MALLOC(NULL, NULL, NULL, ret, xrltContextPtr, sizeof(xrltContext),
-                NULL);
+    // Lookups in the requestsheet dictionary are read-only, so it is safe to
+    // share it between the threads.
+    ret->dict = xmlDictCreateSub(sheet->dict);
 
-    ret->sheet = sheet;
+    if (ret->dict == NULL) {
+        ERROR_OUT_OF_MEMORY(ret, NULL, NULL);
+
+        goto error;
+    }
 
-    ret->responseDoc = xmlNewDoc(NULL);
+    ret->responseDoc = xrltDocCreate(ret);
 
     if (ret->responseDoc == NULL) {
         ERROR_CREATE_NODE(NULL, NULL, NULL);
@@ -247,7 +527,7 @@ xrltContextCreate(xrltRequestsheetPtr sheet, xmlChar **params)
     NEW_CHILD_GOTO(ret, ret->response, response, "response");
     NEW_CHILD_GOTO(ret, ret->var, response, "var");
 
-    ret->xpathDefault = xmlNewDoc(NULL);
+    ret->xpathDefault = xrltDocCreate(ret);
 
     ret->xpath = xmlXPathNewContext(ret->responseDoc);
 
@@ -355,14 +635,38 @@ xrltContextCreate(xrltRequestsheetPtr sheet, xmlChar **params)
         }
     }
 
-    return ret;
+    return TRUE;
 
   error:
-    if (ret != NULL) {
+    return FALSE;
+}
+
+
+xrltContextPtr
+xrltContextCreate(xrltRequestsheetPtr sheet, xmlChar **params)
+{
+    if (sheet == NULL) { return NULL; }
+
+    xrltContextPtr   ret;
+    xrltMemStats    *prev;
+    xrltBool         initialized;
+
+    XRLT_MALLOC(NULL, NULL, NULL, ret, xrltContextPtr, sizeof(xrltContext),
+                NULL);
+
+    xrltMemStatsInit(&ret->mem, ret, sizeof(xrltContext));
+
+    prev = xrltMemStatsSwitch(&ret->mem);
+    initialized = xrltContextInit(ret, sheet, params);
+    xrltMemStatsSwitch(prev);
+
+    if (!initialized) {
         xmlFree(ret);
+
+        return NULL;
     }
 
-    return NULL;
+    return ret;
 }
 
 
@@ -373,8 +677,12 @@ xrltContextFree(xrltContextPtr ctx)
 
     xrltInputCallbackPtr     cb, tmp;
     size_t                   i;
+    xrltMemStats            *prev;
+
+    prev = xrltMemStatsSwitch(&ctx->mem);
 
     xrltSubrequestListClear(&ctx->sr);
+    xrltTaskListClear(&ctx->task);
 
     for (i = 0; i < ctx->icb.size; i++) {
         cb = ctx->icb.q[i].first;
@@ -392,6 +700,10 @@ xrltContextFree(xrltContextPtr ctx)
         xmlFreeDoc(ctx->xpathDefault);
     }
 
+    if (ctx->memo != NULL) {
+        xmlHashFree(ctx->memo, NULL);
+    }
+
     if (ctx->var != NULL) {
         xmlNodePtr   n = ctx->var->children;
         xmlDocPtr    d;
@@ -411,6 +723,12 @@ xrltContextFree(xrltContextPtr ctx)
         xrltTransformCallbackQueueClear(&ctx->tcb);
     }
 
+    for (i = 0; i < ctx->lanesLen; i++) {
+        xrltTransformCallbackQueueClear(&ctx->lanes[i].q);
+    }
+
+    if (ctx->lanes != NULL) { xmlFree(ctx->lanes); }
+
     if (ctx->querystring.data != NULL) {
         xmlFree(ctx->querystring.data);
     }
@@ -431,15 +749,294 @@ xrltContextFree(xrltContextPtr ctx)
         xmlHashFree(ctx->params, NULL);
     }
 
+    if (ctx->profile != NULL) {
+        xmlFree(ctx->profile);
+    }
+
+    if (ctx->trace != NULL) {
+        xmlBufferFree(ctx->trace);
+    }
+
+    if (ctx->dict != NULL) {
+        xmlDictFree(ctx->dict);
+    }
+
+    xrltMemStatsSwitch(prev);
+
+    if (xrltMemStatsEnabled) {
+        xrltMemStatsAdd(&ctx->sheet->mem, &ctx->mem);
+    }
+
     xmlFree(ctx);
 }
 
 
-int
-xrltTransform(xrltContextPtr ctx, size_t id, xrltTransformValue *val)
+#define XRLT_SCHEDULE_LANE_VARIABLES   0
+#define XRLT_SCHEDULE_LANE_TOPLEVEL    1
+#define XRLT_SCHEDULE_LANE_RESPONSE    2
+#define XRLT_SCHEDULE_LANE_BLOCKS      3
+
+
+static inline xrltBool
+xrltSiblingPrecedes(xmlNodePtr a, xmlNodePtr b)
 {
-    if (ctx == NULL || val == NULL) { return XRLT_STATUS_ERROR; }
+    // Walk both siblings forward, so that the cost depends on the distance
+    // between them instead of the number of children.
+    xmlNodePtr   x = a;
+    xmlNodePtr   y = b;
+
+    while (TRUE) {
+        if (x == NULL) { return FALSE; }
+        if (y == NULL) { return TRUE; }
+
+        x = x->next;
+        if (x == b) { return TRUE; }
+
+        y = y->next;
+        if (y == a) { return FALSE; }
+    }
+}
+
+
+static inline xmlNodePtr
+xrltResponseBlock(xrltContextPtr ctx, xmlNodePtr insert)
+{
+    // Returns toplevel response node the insert point belongs to or NULL for
+    // everything outside of it.
+    while (insert != NULL && insert->parent != ctx->response) {
+        insert = insert->parent;
+    }
+
+    return insert;
+}
+
+
+static inline xrltBool
+xrltIsPendingSubrequest(xrltTransformCallbackPtr item)
+{
+    xrltIncludeTransformingData  *tdata;
+
+    if (item->func != xrltIncludeTransform) { return FALSE; }
+
+    tdata = (xrltIncludeTransformingData *)item->data;
+
+    return tdata == NULL ||
+           tdata->stage == XRLT_INCLUDE_TRANSFORM_PARAMS_BEGIN ||
+           tdata->stage == XRLT_INCLUDE_TRANSFORM_PARAMS_END;
+}
+
+
+static xrltScheduleLane *
+xrltScheduleLaneGet(xrltContextPtr ctx, xrltTransformCallbackPtr item)
+{
+    // Returns the lane the callback goes to. Block lanes are kept in the
+    // document order of their blocks, a new one is inserted in place.
+    xrltScheduleLane  *lanes;
+    xmlNodePtr         block;
+    size_t             i, pos;
+
+    block = xrltResponseBlock(ctx, item->insert);
+
+    if (block == NULL) {
+        if (item->insert != NULL && item->insert != ctx->response) {
+            // Variable documents are filled by the callbacks from several
+            // blocks.
+            return &ctx->lanes[XRLT_SCHEDULE_LANE_VARIABLES];
+        }
+
+        if ((ctx->schedule & XRLT_SCHEDULE_DOCUMENT_ORDER) &&
+            item->func == xrltResponseTransform &&
+            item->insert == ctx->response)
+        {
+            return &ctx->lanes[XRLT_SCHEDULE_LANE_RESPONSE];
+        }
+
+        return &ctx->lanes[XRLT_SCHEDULE_LANE_TOPLEVEL];
+    }
+
+    pos = ctx->lanesLen;
+
+    for (i = XRLT_SCHEDULE_LANE_BLOCKS; i < ctx->lanesLen; i++) {
+        if (ctx->lanes[i].block == block) {
+            return &ctx->lanes[i];
+        }
+
+        // Lanes are never empty here, compare with the block of the lane's
+        // head, the node the lane was created for might be replaced by now.
+        if (pos == ctx->lanesLen &&
+            xrltSiblingPrecedes(
+                block, xrltResponseBlock(ctx, ctx->lanes[i].q.first->insert)
+            ))
+        {
+            pos = i;
+        }
+    }
+
+    if (ctx->lanesLen >= ctx->lanesSize) {
+        lanes = (xrltScheduleLane *)xmlRealloc(
+            ctx->lanes, sizeof(xrltScheduleLane) * (ctx->lanesSize + 16)
+        );
+
+        if (lanes == NULL) {
+            ERROR_OUT_OF_MEMORY(ctx, NULL, NULL);
+            return NULL;
+        }
+
+        ctx->lanes = lanes;
+        ctx->lanesSize += 16;
+    }
+
+    memmove(&ctx->lanes[pos + 1], &ctx->lanes[pos],
+            sizeof(xrltScheduleLane) * (ctx->lanesLen - pos));
+    ctx->lanesLen++;
+
+    memset(&ctx->lanes[pos], 0, sizeof(xrltScheduleLane));
+    ctx->lanes[pos].block = block;
+
+    return &ctx->lanes[pos];
+}
+
+
+static xrltBool
+xrltScheduleNext(xrltContextPtr ctx, xrltTransformCallbackQueue **next)
+{
+    // Finds the queue to take the next callback from.
+    //
+    // Callbacks rely on the FIFO order: declarations are processed before
+    // the uses and element's next call comes after the first calls of its
+    // children. So, the callbacks are never reordered inside one toplevel
+    // response block, only the head of some block can jump over the rest.
+    // Blocks do not share variables and counters, so it is safe as long as
+    // the callbacks for variable documents keep their place.
+    //
+    // New callbacks are sorted out to the lanes of their blocks once, so
+    // the choice costs one look at each lane's head.
+    xrltTransformCallbackPtr   item;
+    xrltScheduleLane          *lane;
+    xrltScheduleLane          *best;
+    size_t                     barrier;
+    size_t                     i, j;
+    xrltBool                   pending, bestPending;
+    xrltBool                   docOrder;
+    xrltBool                   srFirst;
+
+    if (ctx->lanes == NULL) {
+        XRLT_MALLOC(ctx, NULL, NULL, ctx->lanes, xrltScheduleLane *,
+                    sizeof(xrltScheduleLane) * (XRLT_SCHEDULE_LANE_BLOCKS + 16),
+                    FALSE);
+
+        ctx->lanesLen = XRLT_SCHEDULE_LANE_BLOCKS;
+        ctx->lanesSize = XRLT_SCHEDULE_LANE_BLOCKS + 16;
+    }
+
+    // Drop the block lanes which have run out of callbacks.
+    for (i = j = XRLT_SCHEDULE_LANE_BLOCKS; i < ctx->lanesLen; i++) {
+        if (ctx->lanes[i].q.first != NULL) {
+            if (i != j) { ctx->lanes[j] = ctx->lanes[i]; }
+            j++;
+        }
+    }
+
+    ctx->lanesLen = j;
+
+    while ((item = ctx->tcb.first) != NULL) {
+        lane = xrltScheduleLaneGet(ctx, item);
+
+        if (lane == NULL) { return FALSE; }
+
+        ctx->tcb.first = item->next;
+        if (item->next == NULL) { ctx->tcb.last = NULL; }
+
+        item->next = NULL;
+        item->order = ctx->scheduled++;
+
+        if (lane->q.first == NULL) {
+            lane->q.first = item;
+        } else {
+            lane->q.last->next = item;
+        }
+        lane->q.last = item;
+    }
+
+    docOrder = ctx->schedule & XRLT_SCHEDULE_DOCUMENT_ORDER ? TRUE : FALSE;
+    srFirst = ctx->schedule & XRLT_SCHEDULE_SUBREQUESTS_FIRST ? TRUE : FALSE;
+
+    // Nothing goes past the callbacks for variable documents.
+    item = ctx->lanes[XRLT_SCHEDULE_LANE_VARIABLES].q.first;
+    barrier = item == NULL ? (size_t)-1 : item->order;
+
+    lane = &ctx->lanes[XRLT_SCHEDULE_LANE_RESPONSE];
+
+    if (lane->q.first != NULL && lane->q.first->order < barrier) {
+        // Response is ready to send something out, do it right away.
+        *next = &lane->q;
+        return TRUE;
+    }
+
+    best = NULL;
+    bestPending = FALSE;
+
+    for (i = XRLT_SCHEDULE_LANE_BLOCKS; i < ctx->lanesLen; i++) {
+        lane = &ctx->lanes[i];
+        item = lane->q.first;
+
+        if (item->order > barrier) { continue; }
+
+        pending = srFirst && xrltIsPendingSubrequest(item);
+
+        if (!docOrder && !pending) { continue; }
+
+        if (best == NULL ||
+            (pending && !bestPending) ||
+            (!docOrder && item->order < best->q.first->order))
+        {
+            best = lane;
+            bestPending = pending;
+        }
+
+        if (docOrder && (bestPending || !srFirst)) {
+            // Lanes are in document order, the rest can't win.
+            break;
+        }
+    }
+
+    if (best == NULL) {
+        // Plain FIFO, the callback sorted out first goes.
+        for (i = 0; i < ctx->lanesLen; i++) {
+            lane = &ctx->lanes[i];
+
+            if (lane->q.first != NULL &&
+                (best == NULL || lane->q.first->order < best->q.first->order))
+            {
+                best = lane;
+            }
+        }
+    }
+
+    *next = best == NULL ? NULL : &best->q;
+
+    return TRUE;
+}
+
+
+static inline xrltBool
+xrltScheduleEmpty(xrltContextPtr ctx)
+{
+    size_t   i;
+
+    if (ctx->tcb.first != NULL) { return FALSE; }
 
+    for (i = 0; i < ctx->lanesLen; i++) {
+        if (ctx->lanes[i].q.first != NULL) { return FALSE; }
+    }
+
+    return TRUE;
+}
+
+
+static int
+xrltTransformRun(xrltContextPtr ctx, size_t id, xrltTransformValue *val)
+{
     xrltTransformFunction     func;
     void                     *comp;
     xmlNodePtr                insert;
@@ -447,13 +1044,23 @@ xrltTransform(xrltContextPtr ctx, size_t id, xrltTransformValue *val)
     xmlNodePtr                xpathContext;
     int                       xpathContextSize;
     int                       xpathProximityPosition;
+    xmlNodePtr                src;
     void                     *data;
     size_t                    len;
     xrltInputCallbackQueue   *q = NULL;
+    xrltTransformCallbackQueue *tcb;
     xrltInputCallbackPtr      cb;
     xrltInputCallbackPtr      prevcb;
+    size_t                    callbacks = 0;
+    size_t                    started = 0;
+    size_t                    profiled = 0;
 
     ctx->cur = XRLT_STATUS_UNKNOWN;
+    ctx->src = NULL;
+
+    if (ctx->budgetTime > 0) {
+        started = xrltTimeNanoseconds();
+    }
 
     if (val->type != XRLT_TRANSFORM_VALUE_EMPTY) {
         len = ctx->icb.size;
@@ -487,6 +1094,7 @@ xrltTransform(xrltContextPtr ctx, size_t id, xrltTransformValue *val)
 
                 case XRLT_TRANSFORM_VALUE_ERROR:
                 case XRLT_TRANSFORM_VALUE_EMPTY:
+                case XRLT_TRANSFORM_VALUE_TASK:
                     break;
             }
         } else if (id < len) {
@@ -505,16 +1113,26 @@ xrltTransform(xrltContextPtr ctx, size_t id, xrltTransformValue *val)
 
             while (cb != NULL) {
                 ctx->varScope = cb->varScope;
+                ctx->src = cb->src;
+
+                if (ctx->profile != NULL) {
+                    profiled = xrltProfileStart(ctx);
+                }
 
                 if (!cb->func(ctx, val, cb->data)) {
                     ctx->cur |= XRLT_STATUS_ERROR;
                     return ctx->cur;
                 }
 
-                if (val->type == XRLT_TRANSFORM_VALUE_BODY &&
-                    val->bodyval.last == TRUE)
+                if (ctx->profile != NULL) {
+                    xrltProfileAdd(ctx, cb->src, profiled);
+                }
+
+                if ((val->type == XRLT_TRANSFORM_VALUE_BODY &&
+                     val->bodyval.last == TRUE) ||
+                    val->type == XRLT_TRANSFORM_VALUE_TASK)
                 {
-                    // If it's the last header or the last body chunk,
+                    // If it's the last body chunk or a finished task,
                     // remove it from the queue.
                     if (prevcb == NULL) {
                         q->first = cb->next;
@@ -538,26 +1156,64 @@ xrltTransform(xrltContextPtr ctx, size_t id, xrltTransformValue *val)
         }
     }
 
-    while (xrltTransformCallbackQueueShift(&ctx->tcb, &func, &comp,
-                                           &insert, &varScope, &xpathContext,
-                                           &xpathContextSize,
-                                           &xpathProximityPosition, &data))
-    {
+    while (TRUE) {
+        tcb = &ctx->tcb;
+
+        if (ctx->schedule != XRLT_SCHEDULE_FIFO &&
+            !xrltScheduleNext(ctx, &tcb))
+        {
+            ctx->cur |= XRLT_STATUS_ERROR;
+            return ctx->cur;
+        }
+
+        if (!xrltTransformCallbackQueueShift(tcb, &func, &comp,
+                                             &insert, &varScope, &xpathContext,
+                                             &xpathContextSize,
+                                             &xpathProximityPosition, &src,
+                                             &data))
+        {
+            break;
+        }
+
         ctx->insert = insert;
         ctx->varScope = varScope;
         ctx->xpathContext = xpathContext;
         ctx->xpathContextSize = xpathContextSize;
         ctx->xpathProximityPosition = xpathProximityPosition;
+        ctx->src = src;
+
+        if (ctx->profile != NULL) {
+            profiled = xrltProfileStart(ctx);
+        }
 
         if (!func(ctx, comp, insert, data)) {
             ctx->cur |= XRLT_STATUS_ERROR;
             return ctx->cur;
         }
 
+        if (ctx->profile != NULL) {
+            xrltProfileAdd(ctx, src, profiled);
+        }
+
+        ctx->callbacks++;
+
         if (ctx->cur != XRLT_STATUS_UNKNOWN) {
             // There is something to send.
             return ctx->cur;
         }
+
+        callbacks++;
+
+        if (((ctx->budgetCallbacks > 0 && callbacks >= ctx->budgetCallbacks) ||
+             (ctx->budgetTime > 0 &&
+              xrltTimeNanoseconds() - started >= ctx->budgetTime)) &&
+            !xrltScheduleEmpty(ctx))
+        {
+            // The budget is exhausted, let the caller breathe and call us
+            // again with an empty value.
+            ctx->cur |= XRLT_STATUS_YIELD;
+            return ctx->cur;
+        }
     }
 
     if (((xrltNodeDataPtr)ctx->responseDoc->_private)->count == 0) {
@@ -572,35 +1228,79 @@ xrltTransform(xrltContextPtr ctx, size_t id, xrltTransformValue *val)
 }
 
 
+int
+xrltTransform(xrltContextPtr ctx, size_t id, xrltTransformValue *val)
+{
+    if (ctx == NULL || val == NULL) { return XRLT_STATUS_ERROR; }
+
+    int             ret;
+    xrltMemStats   *prev;
+    size_t          started = xrltTimeNanoseconds();
+
+    prev = xrltMemStatsSwitch(&ctx->mem);
+    ret = xrltTransformRun(ctx, id, val);
+    xrltMemStatsSwitch(prev);
+
+    ctx->transformTime += xrltTimeNanoseconds() - started;
+
+    return ret;
+}
+
+
 xrltBool
 xrltXPathEval(xrltContextPtr ctx, xmlNodePtr insert, xrltXPathExpr *expr,
               xmlXPathObjectPtr *ret)
 {
     xmlXPathObjectPtr  r;
     xmlNodePtr         node = insert == NULL ? ctx->response : insert;
+    xmlNodePtr         top;
+    xmlDocPtr          root;
     xrltNodeDataPtr    n;
 
-    do {
-        ASSERT_NODE_DATA(node, n);
-        node = node->parent;
-    } while (node != NULL && n->root == NULL);
+    // Callers look the variables up in the scope of the last expression.
+    ctx->varContext = expr->scope;
+    ctx->xpathWait = NULL;
+
+    if (expr->compiled != NULL && xrltXPathEvalFast(ctx, expr, ret)) {
+        return TRUE;
+    }
 
-    if (n->root == NULL)  {
-        ctx->xpath->doc = ctx->xpathDefault;
-        ctx->xpath->node = (xmlNodePtr)ctx->xpathDefault;
+    ASSERT_NODE_DATA(node, n);
+
+    if (n->root == NULL) {
+        // Roots are set before anything is created under the node, so the
+        // nearest one is looked up once and every node on the way keeps it.
+        // The default document stands for no root at all.
+        for (top = node->parent; top != NULL; top = top->parent) {
+            ASSERT_NODE_DATA(top, n);
+
+            if (n->root != NULL) { break; }
+        }
+
+        root = top == NULL ? ctx->xpathDefault : n->root;
+
+        for (; node != top; node = node->parent) {
+            ((xrltNodeDataPtr)node->_private)->root = root;
+        }
     } else {
-        ctx->xpath->doc = n->root;
-        ctx->xpath->node = (xmlNodePtr)n->root;
+        root = n->root;
     }
 
+    ctx->xpath->doc = root;
+    ctx->xpath->node = (xmlNodePtr)root;
+
     if (ctx->xpathContext != NULL) {
         ctx->xpath->node = ctx->xpathContext;
         ctx->xpath->contextSize = ctx->xpathContextSize;
         ctx->xpath->proximityPosition = ctx->xpathProximityPosition;
     }
 
-    ctx->varContext = expr->scope;
-    ctx->xpathWait = NULL;
+    ctx->xpathWait = xrltXPathNotReady(ctx, expr);
+
+    if (ctx->xpathWait != NULL) {
+        *ret = NULL;
+        return TRUE;
+    }
 
     r = xmlXPathCompiledEval(expr->expr, ctx->xpath);
 
@@ -624,14 +1324,79 @@ xrltXPathEval(xrltContextPtr ctx, xmlNodePtr insert, xrltXPathExpr *expr,
 void
 xrltInit(void)
 {
+    // Node registration callbacks are per-thread in libxml2, set the
+    // defaults for threads created later too.
     xmlRegisterNodeDefault(xrltRegisterNodeFunc);
     xmlDeregisterNodeDefault(xrltDeregisterNodeFunc);
+    xmlThrDefRegisterNodeDefault(xrltRegisterNodeFunc);
+    xmlThrDefDeregisterNodeDefault(xrltDeregisterNodeFunc);
+
+    // Don't leave the lazy builtin elements registration to the first
+    // requestsheet compilation, it might happen in several threads at once.
+    xrltRegisterBuiltinElements();
 #ifndef __XRLT_NO_JAVASCRIPT__
     xrltJSInit();
 #endif
 }
 
 
+xrltBool
+xrltMemStatsEnable(void)
+{
+    if (xrltMemStatsEnabled) { return TRUE; }
+
+    if (xmlGcMemGet(&xrltMemFreeOrig, &xrltMemMallocOrig,
+                    &xrltMemMallocAtomicOrig, &xrltMemReallocOrig,
+                    &xrltMemStrdupOrig) != 0)
+    {
+        return FALSE;
+    }
+
+    // The hooks only count and pass everything through, so the memory
+    // allocated before is still freed properly.
+    if (xmlGcMemSetup(xrltMemFree, xrltMemMalloc, xrltMemMallocAtomic,
+                      xrltMemRealloc, xrltMemStrdup) != 0)
+    {
+        return FALSE;
+    }
+
+    xrltMemLive = xrltMemMallocOrig == malloc &&
+                  xrltMemMallocAtomicOrig == malloc &&
+                  xrltMemReallocOrig == realloc &&
+                  xrltMemFreeOrig == free;
+
+    xrltMemStatsEnabled = TRUE;
+
+    return TRUE;
+}
+
+
+void
+xrltContextMemStats(xrltContextPtr ctx, xrltMemStats *stats)
+{
+    if (stats == NULL) { return; }
+
+    if (ctx == NULL) {
+        memset(stats, 0, sizeof(xrltMemStats));
+    } else {
+        *stats = ctx->mem;
+    }
+}
+
+
+void
+xrltRequestsheetMemStats(xrltRequestsheetPtr sheet, xrltMemStats *stats)
+{
+    if (stats == NULL) { return; }
+
+    if (sheet == NULL) {
+        memset(stats, 0, sizeof(xrltMemStats));
+    } else {
+        *stats = sheet->mem;
+    }
+}
+
+
 void
 xrltCleanup(void)
 {
@@ -658,6 +1423,7 @@ xrltInputSubscribe(xrltContextPtr ctx, xrltInputFunction callback,
 
     cb->func = callback;
     cb->varScope = ctx->varScope;
+    cb->src = ctx->src;
     cb->data = payload;
 
     q = ctx->icb.q;
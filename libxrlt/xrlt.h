@@ -30,6 +30,8 @@ extern "C" {
 #define XRLT_STATUS_CHUNK               64
 #define XRLT_STATUS_LOG                 128
 #define XRLT_STATUS_REFUSE_SUBREQUEST   256
+#define XRLT_STATUS_YIELD               512
+#define XRLT_STATUS_TASK                1024
 
 
 #define XRLT_REGISTER_TOPLEVEL   2
@@ -37,6 +39,11 @@ extern "C" {
 #define XRLT_COMPILE_PASS2       8
 
 
+#define XRLT_SCHEDULE_FIFO                0
+#define XRLT_SCHEDULE_DOCUMENT_ORDER      2
+#define XRLT_SCHEDULE_SUBREQUESTS_FIRST   4
+
+
 typedef enum {
     XRLT_TRANSFORM_VALUE_ERROR           = 0,
     XRLT_TRANSFORM_VALUE_EMPTY           = 100,
@@ -44,7 +51,8 @@ typedef enum {
     XRLT_TRANSFORM_VALUE_COOKIE          = 300,
     XRLT_TRANSFORM_VALUE_STATUS          = 400,
     XRLT_TRANSFORM_VALUE_QUERYSTRING     = 500,
-    XRLT_TRANSFORM_VALUE_BODY            = 600
+    XRLT_TRANSFORM_VALUE_BODY            = 600,
+    XRLT_TRANSFORM_VALUE_TASK            = 700
 } xrltTransformValueType;
 
 
@@ -105,6 +113,12 @@ typedef struct {
 } xrltTransformCallbackQueue;
 
 
+typedef struct {
+    xmlNodePtr                   block;  // Toplevel response node.
+    xrltTransformCallbackQueue   q;
+} xrltScheduleLane;
+
+
 typedef struct {
     xrltInputCallbackPtr   first;
     xrltInputCallbackPtr   last;
@@ -117,6 +131,25 @@ typedef struct {
 } xrltInputCallbackQueues;
 
 
+typedef struct {
+    size_t   allocs;    // xmlMalloc() and xmlStrdup() calls.
+    size_t   reallocs;  // xmlRealloc() calls.
+    size_t   frees;     // xmlFree() calls.
+    size_t   bytes;     // Bytes requested by allocations and reallocations,
+                        // cumulative.
+    size_t   live;      // Bytes allocated and not freed yet.
+    size_t   peak;      // Maximum of live, for a requestsheet it is the
+                        // maximum among its contexts. Live and peak are
+                        // zeros unless libxml2 uses the system allocator.
+} xrltMemStats;
+
+
+typedef struct {
+    size_t   calls;     // Callbacks run for a requestsheet node.
+    size_t   time;      // Nanoseconds spent in these callbacks.
+} xrltProfileEntry;
+
+
 typedef void *   (*xrltCompileFunction)     (xrltRequestsheetPtr sheet,
                                              xmlNodePtr node, void *prevcomp);
 typedef void     (*xrltFreeFunction)        (void *comp);
@@ -137,6 +170,9 @@ struct _xrltRequestsheet {
                                    // from.
     xmlHashTablePtr   funcs;       // Functions of this requestsheet.
     xmlHashTablePtr   transforms;  // Transformations of this requestsheet.
+    xmlHashTablePtr   xpath;       // Compiled XPath expressions by their
+                                   // text.
+    xmlHashTablePtr   keys;        // Keys of this requestsheet.
 
     xmlNodePtr        querystringNode;
     void             *querystringComp;
@@ -144,7 +180,17 @@ struct _xrltRequestsheet {
     xmlNodePtr        bodyNode;
     void             *bodyComp;
 
-    void             *js;          // JavaScript context.
+    void             *js;          // JavaScript functions and their
+                                   // contexts (see js.h).
+
+    size_t            nodeCount;   // Number of compiled nodes, they are
+                                   // numbered from 1 for profiling.
+
+    xrltMemStats      mem;         // Allocations of the compilation and of
+                                   // the freed contexts of this requestsheet
+                                   // (see xrltMemStatsEnable()).
+    xmlDictPtr        dict;        // Names of the requestsheet and of the
+                                   // response, read-only once compiled.
 };
 
 
@@ -161,6 +207,9 @@ struct _xrltContext {
     int                          headerCount;  // Wait for headers before
                                                // sending response chunks.
     xrltSubrequestList           sr;           // Subrequests to make.
+    xrltTaskList                 task;         // Tasks to run, every task's
+                                               // id gets XRLT_TRANSFORM_VALUE_
+                                               // TASK once the task is run.
     xrltChunkList                chunk;        // Response chunk.
     xrltLogList                  log;
 
@@ -168,6 +217,10 @@ struct _xrltContext {
     size_t                       maxVarScope;
 
     xmlNodePtr                   sheetNode;
+    xmlDictPtr                   dict;         // Names of the context
+                                               // documents, the requestsheet
+                                               // dictionary is looked up
+                                               // first.
     xmlDocPtr                    responseDoc;
     xmlNodePtr                   response;
     xmlNodePtr                   responseCur;
@@ -176,6 +229,8 @@ struct _xrltContext {
     xmlNodePtr                   var;
     xmlNodePtr                   varContext;
     size_t                       varScope;
+    size_t                       applyScope;   // Scope of xrl:apply
+                                               // parameters being declared.
     xmlDocPtr                    xpathDefault;
     xmlNodePtr                   xpathContext;
     int                          xpathContextSize;
@@ -185,6 +240,59 @@ struct _xrltContext {
 
     xrltTransformCallbackQueue   tcb;
     xrltInputCallbackQueues      icb;
+    int                          schedule;     // Combination of
+                                               // XRLT_SCHEDULE_*, plain FIFO
+                                               // by default.
+    xrltScheduleLane            *lanes;        // Callbacks sorted out by
+    size_t                       lanesLen;     // toplevel response blocks
+    size_t                       lanesSize;    // when schedule is not FIFO.
+    size_t                       scheduled;    // Callbacks sorted out so far.
+    size_t                       budgetCallbacks;  // Return XRLT_STATUS_YIELD
+    size_t                       budgetTime;       // after this many callbacks
+                                                   // or nanoseconds of one
+                                                   // xrltTransform() call, 0
+                                                   // means no limit.
+    xrltBool                     offload;      // Return XSLT transformations
+                                               // as tasks instead of running
+                                               // them in place.
+    size_t                       parseThreshold;  // Include responses of
+                                                  // this size or bigger are
+                                                  // parsed by a task, 0
+                                                  // means never.
+    size_t                       callbacks;    // Transform callbacks run
+                                               // by this context so far.
+    size_t                       transformTime;   // Nanoseconds spent in
+                                                  // xrltTransform() so far.
+    size_t                       subrequests;     // Subrequests issued.
+    size_t                       subrequestTime;  // Nanoseconds between
+                                                  // subrequests issue and
+                                                  // their last body chunk,
+                                                  // summed up.
+    size_t                       jsTime;       // Nanoseconds spent in
+    size_t                       xsltTime;     // JavaScript functions and
+                                               // XSLT transformations.
+    size_t                       bytesOut;     // Response body bytes pushed.
+    xrltMemStats                 mem;          // Allocations made by this
+                                               // context so far.
+    xmlNodePtr                   src;          // Requestsheet node of the
+                                               // callback being run.
+    xrltProfileEntry            *profile;      // Totals per requestsheet
+                                               // node (sheet->nodeCount + 1
+                                               // entries), NULL when not
+                                               // profiling.
+    size_t                       profileSpent; // Nanoseconds added to the
+                                               // profile so far, the time
+                                               // of nested calls is not
+                                               // added to their callers.
+    xmlBufferPtr                 trace;        // Trace events, NULL when
+                                               // not tracing.
+    xmlHashTablePtr              memo;         // Results of pure functions
+                                               // and transformations by
+                                               // their arguments, the
+                                               // documents are in ctx->var.
+    void                        *js;           // JavaScript context of the
+                                               // requestsheet this context
+                                               // runs its functions in.
 
     xrltString                   querystring;
     void                        *headersData;
@@ -202,6 +310,8 @@ struct _xrltTransformCallback {
     xmlNodePtr                 xpathContext;
     int                        xpathContextSize;
     int                        xpathProximityPosition;
+    xmlNodePtr                 src;     // Requestsheet node the callback is
+                                        // run for.
     void                      *data;    // Data allocated by transform
                                         // function. These datas are stored in
                                         // the transformation context. They are
@@ -209,6 +319,9 @@ struct _xrltTransformCallback {
                                         // xrltTransformingElement, when the
                                         // context is being freed.
 
+    size_t                     order;   // Position among the callbacks
+                                        // sorted out by the scheduler.
+
     xrltTransformCallbackPtr   next;    // Next callback in this queue.
 };
 
@@ -216,6 +329,7 @@ struct _xrltTransformCallback {
 struct _xrltInputCallback {
     xrltInputFunction      func;
     size_t                 varScope;
+    xmlNodePtr             src;
     void                  *data;
     xrltInputCallbackPtr   next;
 };
@@ -233,11 +347,61 @@ XRLTPUBFUN xrltBool XRLTCALL
                                    xmlNodePtr insert);
 
 
+/*
+ * Threads: call xrltInit() and register custom elements before starting
+ * the threads. A compiled requestsheet is not modified by transformations,
+ * so it can be shared between threads. A context must be used by one thread
+ * at a time.
+ *
+ * JavaScript runs in a V8 isolate per thread, created on the thread's first
+ * JavaScript call. A requestsheet gets a JavaScript context in every isolate
+ * it is used in, so JavaScript global state is per thread. A context keeps
+ * the JavaScript context of its first call: if it moves to another thread,
+ * its calls wait for the original thread's isolate. Scaling with the number
+ * of threads is linear only when contexts stay on their threads, and every
+ * thread pays for its own V8 heap and for compiling the requestsheet
+ * functions again. Call xrltCleanup() once the threads are done and the
+ * requestsheets are freed, it disposes of the isolates.
+ */
 XRLTPUBFUN void XRLTCALL
         xrltInit                  (void);
 XRLTPUBFUN void XRLTCALL
         xrltCleanup               (void);
 
+/*
+ * Count allocations per context and per requestsheet. Should be called
+ * before xrltInit() and before any threads are started. Allocations made by
+ * tasks on other threads are not counted.
+ */
+XRLTPUBFUN xrltBool XRLTCALL
+        xrltMemStatsEnable        (void);
+XRLTPUBFUN void XRLTCALL
+        xrltContextMemStats       (xrltContextPtr ctx, xrltMemStats *stats);
+XRLTPUBFUN void XRLTCALL
+        xrltRequestsheetMemStats  (xrltRequestsheetPtr sheet,
+                                   xrltMemStats *stats);
+
+/*
+ * Time every callback of the context and dump the totals in collapsed stack
+ * format ("frame;frame;frame nanoseconds" lines) for flame graphs. Frames
+ * are requestsheet elements with their file:line.
+ */
+XRLTPUBFUN xrltBool XRLTCALL
+        xrltProfileEnable         (xrltContextPtr ctx);
+XRLTPUBFUN xrltBool XRLTCALL
+        xrltProfileDump           (xrltContextPtr ctx, xmlBufferPtr buf);
+
+/*
+ * Record subrequests, JavaScript calls, XSLT transformations and response
+ * chunks of the context and dump them as Chrome trace_event JSON (open it in
+ * chrome://tracing). Subrequests are put on their own rows (tid is the
+ * subrequest id).
+ */
+XRLTPUBFUN xrltBool XRLTCALL
+        xrltTraceEnable           (xrltContextPtr ctx);
+XRLTPUBFUN xrltBool XRLTCALL
+        xrltTraceDump             (xrltContextPtr ctx, xmlBufferPtr buf);
+
 
 XRLTPUBFUN xrltRequestsheetPtr XRLTCALL
         xrltRequestsheetCreate    (xmlDocPtr doc);
@@ -64,6 +64,14 @@ typedef enum {
 } xrltCompiledValueType;
 
 
+typedef enum {
+    XRLT_XPATH_GENERIC = 0,
+    XRLT_XPATH_STRING,    // 'literal'
+    XRLT_XPATH_BOOLEAN,   // true() or false()
+    XRLT_XPATH_VARIABLE   // $name or $name/child/child
+} xrltXPathFastType;
+
+
 typedef enum {
     XRLT_HEADER_OUT_HEADER = 0,
     XRLT_HEADER_OUT_COOKIE,
@@ -143,13 +151,79 @@ typedef struct {
 } xrltLogList;
 
 
+typedef void (*xrltTaskFunction)(void *data);
+
+typedef struct _xrltTask xrltTask;
+typedef xrltTask* xrltTaskPtr;
+struct _xrltTask {
+    size_t             id;
+    xrltTaskFunction   run;   // Doesn't touch the context, so it can be
+                              // called from any thread.
+    void              *data;  // Owned by the element which has created the
+                              // task.
+    xrltTaskPtr        next;
+};
+
+typedef struct {
+    xrltTaskPtr   first;
+    xrltTaskPtr   last;
+} xrltTaskList;
+
+
+typedef struct {
+    xmlXPathCompExprPtr   expr;
+    int                   refs;
+    xmlChar             **vars;  // NULL terminated names of the variables
+                                 // the expression refers to, NULL when
+                                 // there are none.
+    xrltXPathFastType     fast;  // Expressions evaluated without XPath
+    xmlChar              *strval;  // engine, the string literal or the
+    xrltBool              boolval; // constant boolean, or the variable
+    xmlChar             **path;    // name followed by child element names
+                                   // (NULL terminated).
+} xrltXPathCompiled;
+
+
 typedef struct {
     xmlNodePtr            src;
     xmlNodePtr            scope;
     xmlXPathCompExprPtr   expr;
+    xrltXPathCompiled    *compiled;  // Shared by every occurrence of the
+                                     // same expression in the requestsheet,
+                                     // expr is a shortcut to compiled->expr.
 } xrltXPathExpr;
 
 
+static inline void
+xrltXPathRelease(xrltXPathCompiled *compiled)
+{
+    int   i;
+
+    if (--compiled->refs > 0) { return; }
+
+    if (compiled->vars != NULL) {
+        for (i = 0; compiled->vars[i] != NULL; i++) {
+            xmlFree(compiled->vars[i]);
+        }
+
+        xmlFree(compiled->vars);
+    }
+
+    if (compiled->path != NULL) {
+        for (i = 0; compiled->path[i] != NULL; i++) {
+            xmlFree(compiled->path[i]);
+        }
+
+        xmlFree(compiled->path);
+    }
+
+    if (compiled->strval != NULL) { xmlFree(compiled->strval); }
+
+    xmlXPathFreeCompExpr(compiled->expr);
+    xmlFree(compiled);
+}
+
+
 typedef struct {
     xrltCompiledValueType   type;
     xmlChar                *textval;
@@ -163,8 +237,8 @@ typedef struct {
     if (val.textval != NULL) {                                                \
         xmlFree(val.textval);                                                 \
     }                                                                         \
-    if (val.xpathval.expr != NULL) {                                          \
-        xmlXPathFreeCompExpr(val.xpathval.expr);                              \
+    if (val.xpathval.compiled != NULL) {                                      \
+        xrltXPathRelease(val.xpathval.compiled);                              \
     }                                                                         \
 }
 
@@ -237,6 +311,18 @@ static inline void
         xrltLogListClear          (xrltLogList *list);
 
 
+static inline void
+        xrltTaskListInit          (xrltTaskList *list);
+static inline xrltBool
+        xrltTaskListPush          (xrltTaskList *list, size_t id,
+                                   xrltTaskFunction run, void *data);
+static inline xrltBool
+        xrltTaskListShift         (xrltTaskList *list, size_t *id,
+                                   xrltTaskFunction *run, void **data);
+static inline void
+        xrltTaskListClear         (xrltTaskList *list);
+
+
 
 static inline xrltBool
 xrltStringInit(xrltString *str, char *val)
@@ -642,6 +728,82 @@ xrltLogListClear(xrltLogList *list)
 }
 
 
+static inline void
+xrltTaskListInit(xrltTaskList *list)
+{
+    memset(list, 0, sizeof(xrltTaskList));
+}
+
+
+static inline xrltBool
+xrltTaskListPush(xrltTaskList *list, size_t id, xrltTaskFunction run,
+                 void *data)
+{
+    if (list == NULL || id == 0 || run == NULL) { return FALSE; }
+
+    xrltTaskPtr t;
+
+    t = (xrltTaskPtr)xmlMalloc(sizeof(xrltTask));
+
+    if (t == NULL) { return FALSE; }
+
+    memset(t, 0, sizeof(xrltTask));
+
+    t->id = id;
+    t->run = run;
+    t->data = data;
+
+    if (list->last == NULL) {
+        list->first = t;
+    } else {
+        list->last->next = t;
+    }
+    list->last = t;
+
+    return TRUE;
+}
+
+
+static inline xrltBool
+xrltTaskListShift(xrltTaskList *list, size_t *id, xrltTaskFunction *run,
+                  void **data)
+{
+    if (list == NULL || id == NULL || run == NULL || data == NULL) {
+        return FALSE;
+    }
+
+    xrltTaskPtr t = list->first;
+
+    if (t == NULL) { return FALSE; }
+
+    *id = t->id;
+    *run = t->run;
+    *data = t->data;
+
+    if (t->next == NULL) {
+        list->first = NULL;
+        list->last = NULL;
+    } else {
+        list->first = t->next;
+    }
+
+    xmlFree(t);
+
+    return TRUE;
+}
+
+
+static inline void
+xrltTaskListClear(xrltTaskList *list)
+{
+    size_t             id;
+    xrltTaskFunction   run;
+    void              *data;
+
+    while (xrltTaskListShift(list, &id, &run, &data));
+}
+
+
 #ifdef __cplusplus
 }
 #endif
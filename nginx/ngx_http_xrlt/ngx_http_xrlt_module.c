@@ -23,11 +23,62 @@ typedef struct {
 
 
 
+typedef struct {
+    ngx_str_t                  path;
+    ngx_http_complex_value_t  *cond;         /* NULL to trace every request */
+} ngx_http_xrlt_trace_t;
+
+
+/* Latency histogram buckets: values below 8 milliseconds get a bucket each,
+ * every next power of two range is split into 4 buckets, the last bucket
+ * takes everything from about 2 minutes up. */
+#define NGX_HTTP_XRLT_STATUS_BUCKETS  64
+
+
+typedef struct {
+    ngx_atomic_t               requests;
+    ngx_atomic_t               errors;
+    ngx_atomic_t               subrequests;
+    ngx_atomic_t               subrequests_max;  /* Per request. */
+    ngx_atomic_t               transform_time;   /* Microseconds. */
+    ngx_atomic_t               mem_max;          /* Peak live bytes of one
+                                                    request, xrlt_mem_stats
+                                                    is required. */
+    ngx_atomic_t               latency[NGX_HTTP_XRLT_STATUS_BUCKETS];
+} ngx_http_xrlt_status_t;
+
+
+typedef struct {
+    ngx_uint_t                 nelts;        /* Number of slots, the zone
+                                                keeps it over reload. */
+    ngx_http_xrlt_status_t     slots[1];
+} ngx_http_xrlt_status_zone_t;
+
+
+typedef struct {
+    ngx_array_t                sheets;       /* ngx_str_t, requestsheet file
+                                                names, index in this array is
+                                                index in the status zone. */
+    ngx_shm_zone_t            *status_zone;
+} ngx_http_xrlt_main_conf_t;
+
+
 typedef struct {
     xrltRequestsheetPtr        sheet;
+    ngx_uint_t                 status_index;
     //ngx_hash_t                 types;
     //ngx_array_t               *types_keys;
     ngx_array_t               *params;       /* ngx_http_xrlt_param_t */
+    ngx_uint_t                 schedule;
+    ngx_int_t                  budget_callbacks;
+    ngx_msec_t                 budget_time;
+    ngx_flag_t                 mem_stats;
+    ngx_open_file_t           *profile;
+    ngx_http_xrlt_trace_t     *trace;
+#if (NGX_THREADS)
+    ngx_thread_pool_t         *thread_pool;
+    size_t                     parse_threshold;
+#endif
 } ngx_http_xrlt_loc_conf_t;
 
 
@@ -40,6 +91,20 @@ static char       *ngx_http_xrlt               (ngx_conf_t *cf,
                                                 ngx_command_t *cmd, void *conf);
 static char       *ngx_http_xrlt_param         (ngx_conf_t *cf,
                                                 ngx_command_t *cmd, void *conf);
+static char       *ngx_http_xrlt_mem_stats     (ngx_conf_t *cf,
+                                                ngx_command_t *cmd, void *conf);
+static char       *ngx_http_xrlt_profile       (ngx_conf_t *cf,
+                                                ngx_command_t *cmd, void *conf);
+static char       *ngx_http_xrlt_trace         (ngx_conf_t *cf,
+                                                ngx_command_t *cmd, void *conf);
+#if (NGX_THREADS)
+static char       *ngx_http_xrlt_thread_pool   (ngx_conf_t *cf,
+                                                ngx_command_t *cmd, void *conf);
+#endif
+static char       *ngx_http_xrlt_status        (ngx_conf_t *cf,
+                                                ngx_command_t *cmd, void *conf);
+static void       *ngx_http_xrlt_create_main_conf
+                                               (ngx_conf_t *cf);
 static void       *ngx_http_xrlt_create_conf   (ngx_conf_t *cf);
 static char       *ngx_http_xrlt_merge_conf    (ngx_conf_t *cf, void *parent,
                                                 void *child);
@@ -52,6 +117,14 @@ ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
 ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
 
 
+static ngx_conf_bitmask_t  ngx_http_xrlt_schedule_mask[] = {
+    { ngx_string("fifo"), NGX_CONF_BITMASK_SET },
+    { ngx_string("document"), XRLT_SCHEDULE_DOCUMENT_ORDER },
+    { ngx_string("subrequests"), XRLT_SCHEDULE_SUBREQUESTS_FIRST },
+    { ngx_null_string, 0 }
+};
+
+
 static ngx_command_t ngx_http_xrlt_commands[] = {
     { ngx_string("xrlt_param"),
       NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF
@@ -67,6 +140,79 @@ static ngx_command_t ngx_http_xrlt_commands[] = {
       NGX_HTTP_LOC_CONF_OFFSET,
       0,
       NULL },
+
+    { ngx_string("xrlt_schedule"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF
+                         | NGX_CONF_1MORE,
+      ngx_conf_set_bitmask_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_xrlt_loc_conf_t, schedule),
+      &ngx_http_xrlt_schedule_mask },
+
+    { ngx_string("xrlt_budget_callbacks"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF
+                         | NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_xrlt_loc_conf_t, budget_callbacks),
+      NULL },
+
+    { ngx_string("xrlt_budget_time"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF
+                         | NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_xrlt_loc_conf_t, budget_time),
+      NULL },
+
+    { ngx_string("xrlt_mem_stats"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF
+                         | NGX_CONF_FLAG,
+      ngx_http_xrlt_mem_stats,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_xrlt_loc_conf_t, mem_stats),
+      NULL },
+
+    { ngx_string("xrlt_profile"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF
+                         | NGX_CONF_TAKE1,
+      ngx_http_xrlt_profile,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("xrlt_trace"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF
+                         | NGX_CONF_TAKE12,
+      ngx_http_xrlt_trace,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("xrlt_status"),
+      NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+      ngx_http_xrlt_status,
+      0,
+      0,
+      NULL },
+
+#if (NGX_THREADS)
+    { ngx_string("xrlt_thread_pool"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF
+                         | NGX_CONF_TAKE1,
+      ngx_http_xrlt_thread_pool,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("xrlt_parse_threshold"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF
+                         | NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_xrlt_loc_conf_t, parse_threshold),
+      NULL },
+#endif
     ngx_null_command
 };
 
@@ -75,7 +221,7 @@ ngx_http_module_t ngx_http_xrlt_module_ctx = {
         ngx_http_xrlt_init,               /*  preconfiguration */
         ngx_http_xrlt_filter_init,        /*  postconfiguration */
 
-        NULL,                             /*  create main configuration */
+        ngx_http_xrlt_create_main_conf,   /*  create main configuration */
         NULL,                             /*  init main configuration */
 
         NULL,                             /*  create server configuration */
@@ -107,18 +253,270 @@ struct ngx_http_xrlt_ctx_s {
     xrltContextPtr        xctx;
     size_t                id;
     ngx_http_xrlt_ctx_t  *main_ctx;
+    ngx_event_t           yield;         /* main context only */
     unsigned              headers_sent:1;
     unsigned              run_post_subrequest:1;
     unsigned              refused:1;
+    unsigned              mem_stats:1;   /* main context only */
+    ngx_open_file_t      *profile;       /* main context only */
+    ngx_str_t             trace_file;    /* main context only */
+    ngx_http_xrlt_status_t  *status;     /* main context only */
+    ngx_msec_t            start;         /* main context only */
 };
 
 
+static void        ngx_http_xrlt_yield_handler (ngx_event_t *ev);
+
+static ngx_int_t   ngx_http_xrlt_time_variable (ngx_http_request_t *r,
+                                                ngx_http_variable_value_t *v,
+                                                uintptr_t data);
+static ngx_int_t   ngx_http_xrlt_size_variable (ngx_http_request_t *r,
+                                                ngx_http_variable_value_t *v,
+                                                uintptr_t data);
+
+
+static ngx_http_variable_t  ngx_http_xrlt_vars[] = {
+
+    { ngx_string("xrlt_transform_time"), NULL, ngx_http_xrlt_time_variable,
+      offsetof(xrltContext, transformTime), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("xrlt_subrequest_count"), NULL, ngx_http_xrlt_size_variable,
+      offsetof(xrltContext, subrequests), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("xrlt_subrequest_wait_time"), NULL,
+      ngx_http_xrlt_time_variable,
+      offsetof(xrltContext, subrequestTime), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("xrlt_js_time"), NULL, ngx_http_xrlt_time_variable,
+      offsetof(xrltContext, jsTime), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("xrlt_xslt_time"), NULL, ngx_http_xrlt_time_variable,
+      offsetof(xrltContext, xsltTime), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("xrlt_callbacks"), NULL, ngx_http_xrlt_size_variable,
+      offsetof(xrltContext, callbacks), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("xrlt_bytes_out"), NULL, ngx_http_xrlt_size_variable,
+      offsetof(xrltContext, bytesOut), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
+
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_http_request_t  *request;
+    size_t               id;
+    xrltTaskFunction     run;
+    void                *data;
+} ngx_http_xrlt_task_t;
+
+
+static ngx_int_t   ngx_http_xrlt_post_tasks    (ngx_http_request_t *r,
+                                                ngx_http_xrlt_ctx_t *ctx);
+static void        ngx_http_xrlt_task_handler  (void *data, ngx_log_t *log);
+static void        ngx_http_xrlt_task_event_handler
+                                               (ngx_event_t *ev);
+
+#endif
+
+
+static ngx_uint_t
+ngx_http_xrlt_status_bucket(ngx_msec_t ms)
+{
+    ngx_uint_t  shift;
+
+    for (shift = 0; (ms >> shift) >= 8; shift++) { /* void */ }
+
+    /* (ms >> shift) is in [4, 8) for every shift but the first one. */
+    shift = shift * 4 + (ms >> shift);
+
+    return shift < NGX_HTTP_XRLT_STATUS_BUCKETS
+        ?
+        shift
+        :
+        NGX_HTTP_XRLT_STATUS_BUCKETS - 1;
+}
+
+
+static ngx_inline void
+ngx_http_xrlt_status_max(ngx_atomic_t *max, ngx_atomic_uint_t val)
+{
+    ngx_atomic_uint_t  old;
+
+    do {
+        old = *max;
+
+        if (old >= val) {
+            return;
+        }
+    } while (!ngx_atomic_cmp_set(max, old, val));
+}
+
+
+static void
+ngx_http_xrlt_status_update(ngx_http_xrlt_ctx_t *ctx)
+{
+    ngx_http_xrlt_status_t  *st = ctx->status;
+    xrltContextPtr           xctx = ctx->xctx;
+    ngx_msec_int_t           ms;
+    xrltMemStats             mem;
+
+    ms = (ngx_msec_int_t)(ngx_current_msec - ctx->start);
+    if (ms < 0) {
+        ms = 0;
+    }
+
+    ngx_atomic_fetch_add(&st->requests, 1);
+    ngx_atomic_fetch_add(&st->latency[ngx_http_xrlt_status_bucket(ms)], 1);
+
+    if (xctx == NULL || xctx->error) {
+        ngx_atomic_fetch_add(&st->errors, 1);
+    }
+
+    if (xctx == NULL) {
+        return;
+    }
+
+    ngx_atomic_fetch_add(&st->subrequests, xctx->subrequests);
+    ngx_atomic_fetch_add(&st->transform_time, xctx->transformTime / 1000);
+
+    ngx_http_xrlt_status_max(&st->subrequests_max, xctx->subrequests);
+
+    if (ctx->mem_stats) {
+        xrltContextMemStats(xctx, &mem);
+        ngx_http_xrlt_status_max(&st->mem_max, mem.peak);
+    }
+}
+
+
 static void
 ngx_http_xrlt_cleanup_context(void *data)
 {
+    ngx_http_xrlt_ctx_t  *ctx = data;
+    xrltMemStats          mem;
+    xmlBufferPtr          buf;
+    ngx_fd_t              fd;
+
     dd("XRLT context cleanup");
 
-    xrltContextFree(data);
+    if (ctx->yield.posted) {
+        ngx_delete_posted_event(&ctx->yield);
+    }
+
+    if (ctx->mem_stats && ctx->xctx != NULL) {
+        xrltContextMemStats(ctx->xctx, &mem);
+
+        ngx_log_error(NGX_LOG_INFO, ctx->yield.log, 0,
+                      "xrlt memory: %uz allocs, %uz reallocs, %uz frees, "
+                      "%uz bytes, %uz peak bytes", mem.allocs, mem.reallocs,
+                      mem.frees, mem.bytes, mem.peak);
+    }
+
+    if (ctx->profile != NULL && ctx->xctx != NULL) {
+        buf = xmlBufferCreate();
+
+        if (buf != NULL) {
+            /* One write per request, so that concurrent workers don't mix
+             * their lines up. */
+            if (xrltProfileDump(ctx->xctx, buf) && xmlBufferLength(buf) > 0 &&
+                ngx_write_fd(ctx->profile->fd, (void *)xmlBufferContent(buf),
+                             xmlBufferLength(buf)) == NGX_FILE_ERROR)
+            {
+                ngx_log_error(NGX_LOG_ALERT, ctx->yield.log, ngx_errno,
+                              ngx_write_fd_n " to \"%s\" failed",
+                              ctx->profile->name.data);
+            }
+
+            xmlBufferFree(buf);
+        }
+    }
+
+    if (ctx->trace_file.len > 0 && ctx->xctx != NULL) {
+        buf = xmlBufferCreate();
+
+        if (buf != NULL && xrltTraceDump(ctx->xctx, buf)) {
+            fd = ngx_open_file(ctx->trace_file.data, NGX_FILE_WRONLY,
+                               NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+
+            if (fd == NGX_INVALID_FILE) {
+                ngx_log_error(NGX_LOG_ALERT, ctx->yield.log, ngx_errno,
+                              ngx_open_file_n " \"%V\" failed",
+                              &ctx->trace_file);
+            } else {
+                if (ngx_write_fd(fd, (void *)xmlBufferContent(buf),
+                                 xmlBufferLength(buf)) == NGX_FILE_ERROR)
+                {
+                    ngx_log_error(NGX_LOG_ALERT, ctx->yield.log, ngx_errno,
+                                  ngx_write_fd_n " to \"%V\" failed",
+                                  &ctx->trace_file);
+                }
+
+                if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+                    ngx_log_error(NGX_LOG_ALERT, ctx->yield.log, ngx_errno,
+                                  ngx_close_file_n " \"%V\" failed",
+                                  &ctx->trace_file);
+                }
+            }
+        }
+
+        if (buf != NULL) {
+            xmlBufferFree(buf);
+        }
+    }
+
+    if (ctx->status != NULL) {
+        ngx_http_xrlt_status_update(ctx);
+    }
+
+    xrltContextFree(ctx->xctx);
+}
+
+
+static ngx_int_t
+ngx_http_xrlt_start_trace(ngx_http_request_t *r, ngx_http_xrlt_ctx_t *ctx,
+                          ngx_http_xrlt_trace_t *trace)
+{
+    ngx_str_t    val;
+    ngx_time_t  *tp;
+    u_char      *p;
+    size_t       len;
+
+    if (trace->cond != NULL) {
+        if (ngx_http_complex_value(r, trace->cond, &val) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (val.len == 0 || (val.len == 1 && val.data[0] == '0')) {
+            return NGX_OK;
+        }
+    }
+
+    if (!xrltTraceEnable(ctx->xctx)) {
+        return NGX_ERROR;
+    }
+
+    /* <path>/<msec>-<pid>-<connection>.json */
+    len = trace->path.len + 1 + NGX_TIME_T_LEN + 3 + 1 + NGX_INT64_LEN + 1
+          + NGX_ATOMIC_T_LEN + sizeof(".json");
+
+    p = ngx_pnalloc(r->pool, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    tp = ngx_timeofday();
+
+    ctx->trace_file.data = p;
+
+    p = ngx_sprintf(p, "%V/%T%03M-%P-%uA.json", &trace->path, tp->sec,
+                    tp->msec, ngx_pid, r->connection->number);
+    *p = '\0';
+
+    ctx->trace_file.len = p - ctx->trace_file.data;
+
+    return NGX_OK;
 }
 
 
@@ -126,6 +524,7 @@ ngx_inline static ngx_http_xrlt_ctx_t *
 ngx_http_xrlt_create_ctx(ngx_http_request_t *r, size_t id) {
     ngx_http_xrlt_ctx_t       *ctx;
     ngx_http_xrlt_loc_conf_t  *conf;
+    ngx_http_xrlt_main_conf_t *xmcf;
     ngx_uint_t                 i, j;
     ngx_http_xrlt_param_t     *params;
     xmlChar                  **xrltparams;
@@ -175,10 +574,52 @@ ngx_http_xrlt_create_ctx(ngx_http_request_t *r, size_t id) {
         if (ctx->xctx == NULL) {
             ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                           "Failed to create XRLT context");
+        } else {
+            ctx->xctx->schedule = conf->schedule & ~NGX_CONF_BITMASK_SET;
+            ctx->xctx->budgetCallbacks = (size_t)conf->budget_callbacks;
+            ctx->xctx->budgetTime = conf->budget_time * 1000000;
+            ctx->mem_stats = conf->mem_stats ? 1 : 0;
+
+            xmcf = ngx_http_get_module_main_conf(r, ngx_http_xrlt_module);
+
+            if (xmcf->status_zone != NULL &&
+                xmcf->status_zone->data != NULL)
+            {
+                ctx->status = ((ngx_http_xrlt_status_zone_t *)
+                               xmcf->status_zone->data)->slots
+                              + conf->status_index;
+                ctx->start = ngx_current_msec;
+            }
+
+            if (conf->profile != NULL) {
+                if (xrltProfileEnable(ctx->xctx)) {
+                    ctx->profile = conf->profile;
+                } else {
+                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                                  "Failed to enable XRLT profiling");
+                }
+            }
+
+            if (conf->trace != NULL &&
+                ngx_http_xrlt_start_trace(r, ctx, conf->trace) != NGX_OK)
+            {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "Failed to enable XRLT tracing");
+            }
+#if (NGX_THREADS)
+            if (conf->thread_pool != NULL) {
+                ctx->xctx->offload = TRUE;
+                ctx->xctx->parseThreshold = conf->parse_threshold;
+            }
+#endif
         }
 
+        ctx->yield.handler = ngx_http_xrlt_yield_handler;
+        ctx->yield.data = r;
+        ctx->yield.log = r->connection->log;
+
         cln->handler = ngx_http_xrlt_cleanup_context;
-        cln->data = ctx->xctx;
+        cln->data = ctx;
     } else {
         ngx_http_xrlt_ctx_t  *main_ctx;
 
@@ -592,6 +1033,14 @@ ngx_http_xrlt_process_transform_result(ngx_http_request_t *r,
         }
     }
 
+#if (NGX_THREADS)
+    if (result & XRLT_STATUS_TASK) {
+        if (ngx_http_xrlt_post_tasks(r->main, ctx->main_ctx) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+#endif
+
     if (result & XRLT_STATUS_DONE) {
         if (!ctx->main_ctx->headers_sent) {
             ctx->main_ctx->headers_sent = 1;
@@ -612,10 +1061,159 @@ ngx_http_xrlt_process_transform_result(ngx_http_request_t *r,
         return NGX_DONE;
     }
 
+    if (result & XRLT_STATUS_YIELD) {
+        // Transformation budget is exhausted, let other requests run and
+        // continue from the posted events queue.
+        dd("Yielding (main: %p)", r->main);
+
+        ngx_post_event(&ctx->main_ctx->yield, &ngx_posted_events);
+
+        return NGX_AGAIN;
+    }
+
     return NGX_OK;
 }
 
 
+static void
+ngx_http_xrlt_resume(ngx_http_request_t *r, ngx_http_xrlt_ctx_t *ctx,
+                     size_t id, xrltTransformValue *val)
+{
+    ngx_connection_t  *c = r->connection;
+    int                result;
+    ngx_int_t          rc;
+
+    result = xrltTransform(ctx->xctx, id, val);
+
+    rc = ngx_http_xrlt_process_transform_result(r, ctx, result);
+
+    if (rc == NGX_OK) {
+        val->type = XRLT_TRANSFORM_VALUE_EMPTY;
+
+        while (rc == NGX_OK) {
+            result = xrltTransform(ctx->xctx, 0, val);
+
+            rc = ngx_http_xrlt_process_transform_result(r, ctx, result);
+        }
+    }
+
+    if (rc == NGX_ERROR) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+    } else if (rc == NGX_DONE) {
+        // Let the write event handler finalize the request.
+        ngx_http_post_request(r, NULL);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_xrlt_yield_handler(ngx_event_t *ev)
+{
+    ngx_http_request_t   *r = ev->data;
+    ngx_http_xrlt_ctx_t  *ctx;
+    xrltTransformValue    val;
+
+    dd("Resume after yield (main: %p)", r);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_xrlt_module);
+
+    val.type = XRLT_TRANSFORM_VALUE_EMPTY;
+
+    ngx_http_xrlt_resume(r, ctx, 0, &val);
+}
+
+
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_xrlt_post_tasks(ngx_http_request_t *r, ngx_http_xrlt_ctx_t *ctx)
+{
+    ngx_http_xrlt_loc_conf_t  *conf;
+    ngx_thread_task_t         *task;
+    ngx_http_xrlt_task_t      *t;
+    size_t                     id;
+    xrltTaskFunction           run;
+    void                      *data;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_xrlt_module);
+
+    while (xrltTaskListShift(&ctx->xctx->task, &id, &run, &data)) {
+        task = ngx_thread_task_alloc(r->pool, sizeof(ngx_http_xrlt_task_t));
+        if (task == NULL) {
+            return NGX_ERROR;
+        }
+
+        t = task->ctx;
+
+        t->request = r;
+        t->id = id;
+        t->run = run;
+        t->data = data;
+
+        task->handler = ngx_http_xrlt_task_handler;
+        task->event.handler = ngx_http_xrlt_task_event_handler;
+        task->event.data = t;
+
+        dd("Posting task (main: %p, id: %zd)", r, id);
+
+        if (ngx_thread_task_post(conf->thread_pool, task) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        // Task data belongs to the XRLT context, the request (and the
+        // context) should survive until the task is complete.
+        r->main->blocked++;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_xrlt_task_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_xrlt_task_t  *t = data;
+
+    t->run(t->data);
+}
+
+
+static void
+ngx_http_xrlt_task_event_handler(ngx_event_t *ev)
+{
+    ngx_http_xrlt_task_t  *t = ev->data;
+    ngx_http_request_t    *r = t->request;
+    ngx_connection_t      *c = r->connection;
+    ngx_http_xrlt_ctx_t   *ctx;
+    xrltTransformValue    val;
+
+    dd("Task complete (main: %p, id: %zd)", r, t->id);
+
+    r->main->blocked--;
+
+    if (c->error) {
+        // The request has been terminated while the task was running, let
+        // the finalizer do its job.
+        r = c->data;
+        r->write_event_handler(r);
+
+        ngx_http_run_posted_requests(c);
+
+        return;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_xrlt_module);
+
+    val.type = XRLT_TRANSFORM_VALUE_TASK;
+
+    ngx_http_xrlt_resume(r, ctx, t->id, &val);
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_http_xrlt_transform_body(ngx_http_request_t *r, ngx_http_xrlt_ctx_t *ctx,
                              size_t id, xrltString *val, xrltBool last,
@@ -901,9 +1499,157 @@ ngx_http_xrlt_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 static ngx_int_t
 ngx_http_xrlt_init(ngx_conf_t *cf)
 {
+    ngx_http_variable_t  *var, *v;
+
     xmlInitParser();
     xrltInit();
 
+    for (v = ngx_http_xrlt_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
+static size_t *
+ngx_http_xrlt_counter(ngx_http_request_t *r, uintptr_t data)
+{
+    ngx_http_xrlt_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_xrlt_module);
+
+    if (ctx == NULL || ctx->main_ctx->xctx == NULL) {
+        return NULL;
+    }
+
+    return (size_t *)((char *)ctx->main_ctx->xctx + data);
+}
+
+
+static ngx_int_t
+ngx_http_xrlt_time_variable(ngx_http_request_t *r,
+                            ngx_http_variable_value_t *v, uintptr_t data)
+{
+    size_t  *ns;
+    u_char  *p;
+
+    ns = ngx_http_xrlt_counter(r, data);
+
+    if (ns == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_TIME_T_LEN + 4);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* Seconds with milliseconds resolution, like $request_time. */
+    v->len = ngx_sprintf(p, "%uz.%03uz", *ns / 1000000000,
+                         *ns / 1000000 % 1000) - p;
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_xrlt_size_variable(ngx_http_request_t *r,
+                            ngx_http_variable_value_t *v, uintptr_t data)
+{
+    size_t  *n;
+    u_char  *p;
+
+    n = ngx_http_xrlt_counter(r, data);
+
+    if (n == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_SIZE_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%uz", *n) - p;
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_xrlt_init_status_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_xrlt_main_conf_t    *xmcf = shm_zone->data;
+    ngx_http_xrlt_status_zone_t  *old = data;
+    ngx_http_xrlt_status_zone_t  *zone;
+    ngx_slab_pool_t              *shpool;
+    size_t                        size;
+
+    size = offsetof(ngx_http_xrlt_status_zone_t, slots)
+           + sizeof(ngx_http_xrlt_status_t) * xmcf->sheets.nelts;
+
+    if (old != NULL && old->nelts == xmcf->sheets.nelts) {
+        /* The zone is kept over reload, but requestsheets could have been
+         * changed, counters start over. */
+        ngx_memzero(old->slots,
+                    sizeof(ngx_http_xrlt_status_t) * old->nelts);
+        shm_zone->data = old;
+
+        return NGX_OK;
+    }
+
+    /* The zone is kept over reload as long as its size is the same, which
+     * does not mean the number of requestsheets is. The slots are then
+     * allocated again.
+     *
+     * During a graceful reload the old workers keep updating the counters
+     * of the old block until they exit. The new block is allocated before
+     * the old one is freed, so that their writes go to the freed block as
+     * long as the zone has room for both. Nothing else is allocated in the
+     * zone, so the writes can't damage anything there. Without the room,
+     * the new block might take the place of the old one and the old
+     * workers would skew the new counters until they exit. */
+
+    shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    zone = ngx_slab_calloc_locked(shpool, size);
+
+    if (old != NULL) {
+        ngx_slab_free_locked(shpool, old);
+
+        if (zone == NULL) {
+            zone = ngx_slab_calloc_locked(shpool, size);
+        }
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    zone->nelts = xmcf->sheets.nelts;
+    shm_zone->data = zone;
+
     return NGX_OK;
 }
 
@@ -911,6 +1657,27 @@ ngx_http_xrlt_init(ngx_conf_t *cf)
 static ngx_int_t
 ngx_http_xrlt_filter_init(ngx_conf_t *cf)
 {
+    ngx_http_xrlt_main_conf_t  *xmcf;
+    ngx_str_t                   name = ngx_string("xrlt_status");
+    size_t                      size;
+
+    xmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_xrlt_module);
+
+    if (xmcf->sheets.nelts > 0) {
+        size = offsetof(ngx_http_xrlt_status_zone_t, slots)
+               + sizeof(ngx_http_xrlt_status_t) * xmcf->sheets.nelts;
+        size = ngx_align(size, ngx_pagesize) + 8 * ngx_pagesize;
+
+        xmcf->status_zone = ngx_shared_memory_add(cf, &name, size,
+                                                  &ngx_http_xrlt_module);
+        if (xmcf->status_zone == NULL) {
+            return NGX_ERROR;
+        }
+
+        xmcf->status_zone->init = ngx_http_xrlt_init_status_zone;
+        xmcf->status_zone->data = xmcf;
+    }
+
     ngx_http_next_header_filter = ngx_http_top_header_filter;
     ngx_http_top_header_filter = ngx_http_xrlt_header_filter;
 
@@ -1031,8 +1798,10 @@ static char *
 ngx_http_xrlt(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
     ngx_http_xrlt_loc_conf_t  *xlcf = conf;
     ngx_http_core_loc_conf_t  *clcf;
+    ngx_http_xrlt_main_conf_t *xmcf;
 
     ngx_str_t                 *value;
+    ngx_str_t                 *name;
     ngx_pool_cleanup_t        *cln;
 
     xmlDocPtr                 doc;
@@ -1076,6 +1845,16 @@ ngx_http_xrlt(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
     cln->handler = ngx_http_xrlt_cleanup_requestsheet;
     cln->data = sheet;
 
+    xmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_xrlt_module);
+
+    name = ngx_array_push(&xmcf->sheets);
+    if (name == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *name = value[1];
+    xlcf->status_index = xmcf->sheets.nelts - 1;
+
     clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
     if (clcf == NULL) {
         return NGX_CONF_ERROR;
@@ -1134,6 +1913,294 @@ ngx_http_xrlt_param(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+static char *
+ngx_http_xrlt_mem_stats(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_xrlt_loc_conf_t  *xlcf = conf;
+
+    char                      *rv;
+
+    rv = ngx_conf_set_flag_slot(cf, cmd, conf);
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    /* Requestsheets compiled after this point get their compilation
+     * counted too, so it's better to turn it on on the http level. */
+    if (xlcf->mem_stats && !xrltMemStatsEnable()) {
+        return "failed to set up allocation hooks";
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_xrlt_profile(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_xrlt_loc_conf_t  *xlcf = conf;
+
+    ngx_str_t                 *value;
+
+    if (xlcf->profile != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        xlcf->profile = NULL;
+        return NGX_CONF_OK;
+    }
+
+    /* Collapsed stacks of every request are appended to this file. */
+    xlcf->profile = ngx_conf_open_file(cf->cycle, &value[1]);
+    if (xlcf->profile == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_xrlt_trace(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_xrlt_loc_conf_t          *xlcf = conf;
+
+    ngx_str_t                         *value;
+    ngx_http_xrlt_trace_t             *trace;
+    ngx_http_compile_complex_value_t   ccv;
+
+    if (xlcf->trace != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts > 2) {
+            return "takes no condition with \"off\"";
+        }
+
+        xlcf->trace = NULL;
+        return NGX_CONF_OK;
+    }
+
+    trace = ngx_pcalloc(cf->pool, sizeof(ngx_http_xrlt_trace_t));
+    if (trace == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* Every traced request gets its own file in this directory. */
+    trace->path = value[1];
+
+    if (ngx_conf_full_name(cf->cycle, &trace->path, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts > 2) {
+        /* Something like $http_x_xrlt_trace or $arg_trace, the request is
+         * traced when it's not empty and not "0". */
+        trace->cond = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+        if (trace->cond == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+        ccv.cf = cf;
+        ccv.value = &value[2];
+        ccv.complex_value = trace->cond;
+
+        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    xlcf->trace = trace;
+
+    return NGX_CONF_OK;
+}
+
+
+#if (NGX_THREADS)
+
+static char *
+ngx_http_xrlt_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_xrlt_loc_conf_t  *xlcf = conf;
+
+    ngx_str_t                 *value;
+
+    if (xlcf->thread_pool != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        xlcf->thread_pool = NULL;
+        return NGX_CONF_OK;
+    }
+
+    xlcf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+    if (xlcf->thread_pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_xrlt_status_handler(ngx_http_request_t *r)
+{
+    ngx_http_xrlt_main_conf_t  *xmcf;
+    ngx_http_xrlt_status_t     *st;
+    ngx_str_t                  *names;
+    ngx_chain_t                 out;
+    ngx_buf_t                  *b;
+    ngx_int_t                   rc;
+    ngx_uint_t                  i, j, shift, lo;
+    size_t                      size;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    xmcf = ngx_http_get_module_main_conf(r, ngx_http_xrlt_module);
+
+    names = xmcf->sheets.elts;
+    st = xmcf->status_zone != NULL && xmcf->status_zone->data != NULL
+         ? ((ngx_http_xrlt_status_zone_t *)xmcf->status_zone->data)->slots
+         : NULL;
+
+    size = 0;
+
+    for (i = 0; st != NULL && i < xmcf->sheets.nelts; i++) {
+        size += sizeof("sheet: \n") - 1 + names[i].len
+                + sizeof("requests:  errors: \n") - 1 + 2 * NGX_ATOMIC_T_LEN
+                + sizeof("subrequests:  max: \n") - 1 + 2 * NGX_ATOMIC_T_LEN
+                + sizeof("transform_us: \n") - 1 + NGX_ATOMIC_T_LEN
+                + sizeof("mem_max_bytes: \n") - 1 + NGX_ATOMIC_T_LEN
+                + sizeof("latency_ms:\n") - 1
+                + NGX_HTTP_XRLT_STATUS_BUCKETS
+                  * (sizeof(" -:") - 1 + 3 * NGX_ATOMIC_T_LEN)
+                + sizeof("\n") - 1;
+    }
+
+    r->headers_out.content_type_len = sizeof("text/plain") - 1;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_lowcase = NULL;
+
+    if (size == 0) {
+        r->header_only = 1;
+        r->headers_out.status = NGX_HTTP_OK;
+        r->headers_out.content_length_n = 0;
+
+        return ngx_http_send_header(r);
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    for (i = 0; i < xmcf->sheets.nelts; i++, st++) {
+        b->last = ngx_sprintf(b->last, "sheet: %V\n", &names[i]);
+        b->last = ngx_sprintf(b->last, "requests: %uA errors: %uA\n",
+                              st->requests, st->errors);
+        b->last = ngx_sprintf(b->last, "subrequests: %uA max: %uA\n",
+                              st->subrequests, st->subrequests_max);
+        b->last = ngx_sprintf(b->last, "transform_us: %uA\n",
+                              st->transform_time);
+        b->last = ngx_sprintf(b->last, "mem_max_bytes: %uA\n", st->mem_max);
+        b->last = ngx_sprintf(b->last, "latency_ms:");
+
+        /* Only non-empty buckets as " <from>-<to>:<count>", <to> is not
+         * included, the last bucket has no upper bound. */
+        for (j = 0; j < NGX_HTTP_XRLT_STATUS_BUCKETS; j++) {
+            if (st->latency[j] == 0) {
+                continue;
+            }
+
+            shift = j < 8 ? 0 : j / 4 - 1;
+            lo = j < 8 ? j : (j - shift * 4) << shift;
+
+            if (j == NGX_HTTP_XRLT_STATUS_BUCKETS - 1) {
+                b->last = ngx_sprintf(b->last, " %ui-:%uA", lo,
+                                      st->latency[j]);
+            } else {
+                b->last = ngx_sprintf(b->last, " %ui-%ui:%uA", lo,
+                                      lo + ((ngx_uint_t)1 << shift),
+                                      st->latency[j]);
+            }
+        }
+
+        *b->last++ = '\n';
+        *b->last++ = '\n';
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static char *
+ngx_http_xrlt_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_xrlt_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_http_xrlt_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_xrlt_main_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_xrlt_main_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&conf->sheets, cf->pool, 4, sizeof(ngx_str_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return conf;
+}
+
+
 static void *
 ngx_http_xrlt_create_conf(ngx_conf_t *cf)
 {
@@ -1144,6 +2211,16 @@ ngx_http_xrlt_create_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+    conf->budget_callbacks = NGX_CONF_UNSET;
+    conf->budget_time = NGX_CONF_UNSET_MSEC;
+    conf->mem_stats = NGX_CONF_UNSET;
+    conf->profile = NGX_CONF_UNSET_PTR;
+    conf->trace = NGX_CONF_UNSET_PTR;
+#if (NGX_THREADS)
+    conf->thread_pool = NGX_CONF_UNSET_PTR;
+    conf->parse_threshold = NGX_CONF_UNSET_SIZE;
+#endif
+
     return conf;
 }
 
@@ -1157,6 +2234,19 @@ ngx_http_xrlt_merge_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_uint_t                 i, j;
     xrltBool                   add;
 
+    ngx_conf_merge_bitmask_value(conf->schedule, prev->schedule,
+                                 NGX_CONF_BITMASK_SET);
+    ngx_conf_merge_value(conf->budget_callbacks, prev->budget_callbacks, 0);
+    ngx_conf_merge_msec_value(conf->budget_time, prev->budget_time, 0);
+    ngx_conf_merge_value(conf->mem_stats, prev->mem_stats, 0);
+    ngx_conf_merge_ptr_value(conf->profile, prev->profile, NULL);
+    ngx_conf_merge_ptr_value(conf->trace, prev->trace, NULL);
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+    ngx_conf_merge_size_value(conf->parse_threshold, prev->parse_threshold,
+                              0);
+#endif
+
     if (conf->params == NULL) {
         conf->params = prev->params;
     } else if (prev->params != NULL) {